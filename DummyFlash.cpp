@@ -3,22 +3,98 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#ifndef ARDUINO
+//file backed images only exist on the host
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "DummyFlash.h"
 
 
 #define BLOCK_SIZE 4096
 
-#define MAX_ADDR (blockCount * 4096)
+#define MAX_ADDR ((long)blockCount * 4096)
 
-DummyFlash::DummyFlash(int _blockCount):blockCount(_blockCount) {
+DummyFlash::DummyFlash(int _blockCount):blockCount(_blockCount), fileBacked(false) {
 	printf("size: %i\n", (int)sizeof(struct dummyblock_t));
 	assert(sizeof(struct dummyblock_t) == 4096);
 	data = (struct dummyblock_t*)malloc(blockCount * sizeof(struct dummyblock_t));
 	assert(data);
+	//a new chip comes erased
+	memset(data, 0xff, (long)blockCount * sizeof(struct dummyblock_t));
 	eraseCounter = (int*)calloc(blockCount, sizeof(int));
 }
 
+#ifndef ARDUINO
+DummyFlash::DummyFlash(int _blockCount, const char* imageFile):blockCount(_blockCount), fileBacked(true) {
+	assert(sizeof(struct dummyblock_t) == 4096);
+	//a new chip comes erased
+	data = (struct dummyblock_t*)mapFile(imageFile, (long)blockCount * sizeof(struct dummyblock_t), 0xff);
+
+	char* wearFile = (char*)malloc(strlen(imageFile) + 6);
+	strcpy(wearFile, imageFile);
+	strcat(wearFile, ".wear");
+	eraseCounter = (int*)mapFile(wearFile, (long)blockCount * sizeof(int), 0);
+	free(wearFile);
+	if(data == 0 || eraseCounter == 0) {
+		//isValid() tells the caller
+		if(data) munmap(data, (long)blockCount * sizeof(struct dummyblock_t));
+		if(eraseCounter) munmap(eraseCounter, (long)blockCount * sizeof(int));
+		data = 0;
+		eraseCounter = 0;
+	}
+}
+
+//maps the file shared into memory. A new file is created with size bytes of fill.
+//Returns 0 and prints the reason, if it can't be mapped or an existing file has another size
+void* DummyFlash::mapFile(const char* fileName, long size, uint8_t fill) {
+	int fd = open(fileName, O_RDWR | O_CREAT, 0644);
+	if(fd < 0) {
+		perror(fileName);
+		return 0;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0) {
+		perror(fileName);
+		close(fd);
+		return 0;
+	}
+	bool created = st.st_size == 0;
+	if(created && ftruncate(fd, size) != 0) {
+		perror(fileName);
+		close(fd);
+		return 0;
+	}
+	if(!created && st.st_size != size) {
+		fprintf(stderr, "%s: has %li bytes instead of %li\n", fileName, (long)st.st_size, size);
+		close(fd);
+		return 0;
+	}
+	void* mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(mem == MAP_FAILED) {
+		perror(fileName);
+		close(fd);
+		return 0;
+	}
+	//the mapping stays valid after closing the descriptor
+	close(fd);
+	if(created) {
+		memset(mem, fill, size);
+	}
+	return mem;
+}
+#endif
+
 DummyFlash::~DummyFlash() {
+#ifndef ARDUINO
+	if(fileBacked) {
+		if(data) munmap(data, (long)blockCount * sizeof(struct dummyblock_t));
+		if(eraseCounter) munmap(eraseCounter, (long)blockCount * sizeof(int));
+		return;
+	}
+#endif
 	free(data);
 	free(eraseCounter);
 }
@@ -41,10 +117,21 @@ void DummyFlash::writeByte(long addr, uint8_t byt) {
 
 void DummyFlash::writeBytes(long addr, const void* buf, int len) {
 	assert(addr + len <= MAX_ADDR);
-	uint8_t* bytes = (uint8_t*)buf;
+	const uint8_t* bytes = (const uint8_t*)buf;
+	uint8_t* dst = ((uint8_t*)data) + addr;
+	//program word wise. memcpy keeps it alignment safe and the compiler turns the loop into simd
+	while(len >= (int)sizeof(uint64_t)) {
+		uint64_t old, byt;
+		memcpy(&old, dst, sizeof(old));
+		memcpy(&byt, bytes, sizeof(byt));
+		old &= byt;
+		memcpy(dst, &old, sizeof(old));
+		dst += sizeof(uint64_t);
+		bytes += sizeof(uint64_t);
+		len -= sizeof(uint64_t);
+	}
 	while(len-- > 0) {
-		writeByte(addr++, *bytes);
-		bytes++;
+		*dst++ &= *bytes++;
 	}
 }
 
@@ -15,20 +15,41 @@ struct dummyblock_t{
 class DummyFlash {
 public:
 	DummyFlash(int blockCount);
+#ifndef ARDUINO
+	//file backed flash on the host. the image is mapped into memory and persists across runs,
+	//the erase counters are kept in <imageFile>.wear. An existing image has to have the same size
+	DummyFlash(int blockCount, const char* imageFile);
+#endif
 	~DummyFlash();
+	//false, if the image couldn't be mapped
+	bool isValid() { return data != 0; }
 	uint8_t readByte(long addr);
 	void readBytes(long addr, void* buf, long len);
 	void writeByte(long addr, uint8_t byt);
 	void writeBytes(long addr, const void* buf, int len);
+	bool busy() { return false; }
+	void waitIdle() {}
+	//there is no deep power-down
+	bool sleepDue() { return false; }
+	void sleep() {}
+	void wakeup() {}
+	long getCapacity() { return (long)blockCount * sizeof(struct dummyblock_t); }
 	void chipErase();
 	void blockErase4K(long address);
 	//void blockErase32K(long address);
 
 	void printWearLevel();
+	int getEraseCount(int block) { return eraseCounter[block]; }
   protected:
+#ifndef ARDUINO
+	static void* mapFile(const char* fileName, long size, uint8_t fill);
+#endif
+
 	struct dummyblock_t* data;
 	int blockCount;
 	int* eraseCounter;
+	//true if data and eraseCounter are mmaped files
+	bool fileBacked;
 };
 
 #endif
@@ -0,0 +1,14 @@
+#ifndef _FLASHCRC_H_
+#define _FLASHCRC_H_
+
+#include <inttypes.h>
+
+//CRC-32 (the one of zlib and ethernet), slicing-by-8: eight bytes per step with eight constant 1k tables.
+//On AVR bytewise with one 1k table in program memory
+//
+//crc is the result for the preceding data, 0 to start:
+//  uint32_t crc = flashcrc32(0, a, aLen);
+//  crc = flashcrc32(crc, b, bLen);
+uint32_t flashcrc32(uint32_t crc, const void* data, long len);
+
+#endif
@@ -0,0 +1,313 @@
+#include "FlashFS.h"
+#include <string.h>
+
+//"FFS1"
+#define FLASHFS_MAGIC 0x31534646UL
+//data blocks start after the directory block
+#define FIRST_DATA_BLOCK 1
+//extents are 16 bit, larger levelers only use the first 65535 blocks
+#define MAX_BLOCKS 0xffffL
+
+static long minLong(long a, long b) {
+	return a < b ? a : b;
+}
+
+
+FlashFS::FlashFS(FlashWearLevelerBase& _leveler):leveler(_leveler), dirDirty(false), discardCount(0), partialDiscard(false) {
+	memset(dir, 0, sizeof(dir));
+	blockSize = leveler.getBlockSize();
+	blockTotal = minLong(leveler.getSize() / blockSize, MAX_BLOCKS);
+}
+
+
+bool FlashFS::mount() {
+	uint32_t magic;
+	blockSize = leveler.getBlockSize();
+	blockTotal = minLong(leveler.getSize() / blockSize, MAX_BLOCKS);
+	leveler.readBytes(0, &magic, sizeof(magic));
+	if(magic != FLASHFS_MAGIC) {
+		return false;
+	}
+	leveler.readBytes(sizeof(magic), dir, sizeof(dir));
+	dirDirty = false;
+	discardCount = 0;
+	partialDiscard = false;
+	return true;
+}
+
+
+bool FlashFS::format() {
+	blockSize = leveler.getBlockSize();
+	blockTotal = minLong(leveler.getSize() / blockSize, MAX_BLOCKS);
+	memset(dir, 0, sizeof(dir));
+	discardCount = 0;
+	partialDiscard = false;
+	//everything after the directory is free now
+	leveler.discard(FIRST_DATA_BLOCK * blockSize, (long)(blockTotal - FIRST_DATA_BLOCK) * blockSize);
+	dirDirty = true;
+	return sync() == 0;
+}
+
+
+int FlashFS::sync() {
+	if(dirDirty) {
+		uint32_t magic = FLASHFS_MAGIC;
+		//both land in the directory block, so it gets flushed once
+		leveler.writeBytes(0, &magic, sizeof(magic));
+		leveler.writeBytes(sizeof(magic), dir, sizeof(dir));
+		dirDirty = false;
+	}
+	//the discards have to wait for the directory
+	if(!leveler.flush()) return -1;
+	if(discardCount > 0) {
+		//the directory on flash doesn't reference the ranges anymore
+		int i;
+		for(i=0; i<discardCount; i++) {
+			leveler.discard(discardAddr[i], discardLen[i]);
+		}
+		discardCount = 0;
+		partialDiscard = false;
+		if(!leveler.flush()) return -1;
+	}
+	return 0;
+}
+
+
+void FlashFS::deferDiscard(long addr, long len) {
+	discardAddr[discardCount] = addr;
+	discardLen[discardCount] = len;
+	discardCount++;
+}
+
+
+int FlashFS::find(const char* name) {
+	int i;
+	for(i=0; i<FLASHFS_MAX_FILES; i++) {
+		if(dir[i].name[0] != 0 && strncmp(dir[i].name, name, FLASHFS_NAME_LENGTH) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+int FlashFS::create(const char* name) {
+	if(name[0] == 0) return -1;
+	int fd = find(name);
+	if(fd >= 0) {
+		truncate(fd, 0);
+		return fd;
+	}
+	for(fd=0; fd<FLASHFS_MAX_FILES; fd++) {
+		if(dir[fd].name[0] == 0) {
+			memset(&dir[fd], 0, sizeof(dir[fd]));
+			strncpy(dir[fd].name, name, FLASHFS_NAME_LENGTH);
+			dirDirty = true;
+			return fd;
+		}
+	}
+	//directory full
+	return -1;
+}
+
+
+int FlashFS::open(const char* name) {
+	return find(name);
+}
+
+
+long FlashFS::size(int fd) {
+	if(fd < 0 || fd >= FLASHFS_MAX_FILES || dir[fd].name[0] == 0) return -1;
+	return dir[fd].size;
+}
+
+
+const flashfs_entry_t* FlashFS::stat(int fd) {
+	if(size(fd) < 0) return 0;
+	return &dir[fd];
+}
+
+
+bool FlashFS::isBlockFree(uint16_t block) {
+	if(block < FIRST_DATA_BLOCK || block >= blockTotal) return false;
+	int i, e;
+	//freed, but not discarded yet
+	long addr = (long)block * blockSize;
+	for(i=0; i<discardCount; i++) {
+		if(addr >= discardAddr[i] && addr < discardAddr[i] + discardLen[i]) return false;
+	}
+	for(i=0; i<FLASHFS_MAX_FILES; i++) {
+		if(dir[i].name[0] == 0) continue;
+		for(e=0; e<FLASHFS_MAX_EXTENTS; e++) {
+			const flashfs_extent_t& ext = dir[i].extents[e];
+			if(block >= ext.start && block < ext.start + ext.count) return false;
+		}
+	}
+	return true;
+}
+
+
+//makes sure the file owns at least the given number of blocks
+//grows the last extent in place if possible, otherwise allocates a new extent with first fit
+bool FlashFS::reserve(flashfs_entry_t& entry, long blocks) {
+	long have = 0;
+	int used = 0;
+	while(used < FLASHFS_MAX_EXTENTS && entry.extents[used].count != 0) {
+		have += entry.extents[used].count;
+		used++;
+	}
+
+	while(have < blocks) {
+		if(used > 0) {
+			flashfs_extent_t& last = entry.extents[used - 1];
+			if(isBlockFree(last.start + last.count)) {
+				last.count++;
+				have++;
+				dirDirty = true;
+				continue;
+			}
+		}
+		if(used == FLASHFS_MAX_EXTENTS) return false;
+
+		//first run that fits everything, otherwise the longest one
+		long need = blocks - have;
+		uint16_t bestStart = 0, bestCount = 0;
+		uint16_t b = FIRST_DATA_BLOCK;
+		while(b < blockTotal && bestCount < need) {
+			if(!isBlockFree(b)) {
+				b++;
+				continue;
+			}
+			uint16_t start = b;
+			while(b < blockTotal && b - start < need && isBlockFree(b)) b++;
+			if(b - start > bestCount) {
+				bestStart = start;
+				bestCount = b - start;
+			}
+		}
+		if(bestCount == 0) return false;
+		entry.extents[used].start = bestStart;
+		entry.extents[used].count = bestCount;
+		used++;
+		have += bestCount;
+		dirDirty = true;
+	}
+	return true;
+}
+
+
+//translates a file position into a virtual address
+//contiguous is set to the number of bytes, that follow the position in the same extent
+long FlashFS::fileAddress(const flashfs_entry_t& entry, long pos, long* contiguous) {
+	long fileBlock = pos / blockSize;
+	int e;
+	for(e=0; e<FLASHFS_MAX_EXTENTS; e++) {
+		const flashfs_extent_t& ext = entry.extents[e];
+		if(fileBlock < ext.count) {
+			*contiguous = (ext.count - fileBlock) * blockSize - pos % blockSize;
+			return (ext.start + fileBlock) * blockSize + pos % blockSize;
+		}
+		fileBlock -= ext.count;
+	}
+	*contiguous = 0;
+	return -1;
+}
+
+
+long FlashFS::append(int fd, const void* buf, long len) {
+	if(size(fd) < 0) return -1;
+	//the pending discard of a partial block could hit the appended data
+	if(partialDiscard) sync();
+	flashfs_entry_t& entry = dir[fd];
+	long blocks = (entry.size + len + blockSize - 1) / blockSize;
+	flashfs_entry_t before = entry;
+	bool dirDirtyBefore = dirDirty;
+	if(!reserve(entry, blocks)) {
+		//give back, what reserve() took before it failed
+		entry = before;
+		dirDirty = dirDirtyBefore;
+		if(discardCount == 0) return -1;
+		//the freed blocks become available with the sync
+		sync();
+		if(!reserve(entry, blocks)) {
+			entry = before;
+			dirDirty = false;
+			return -1;
+		}
+	}
+
+	//one bulk write per extent
+	long done = 0;
+	while(done < len) {
+		long contiguous;
+		long addr = fileAddress(entry, entry.size + done, &contiguous);
+		long n = minLong(contiguous, len - done);
+		//the size stays, the data behind it gets written again by the next append
+		if(leveler.writeBytes(addr, (const uint8_t*)buf + done, n) != 0) return -1;
+		done += n;
+	}
+	entry.size += len;
+	dirDirty = true;
+	return len;
+}
+
+
+long FlashFS::read(int fd, long offset, void* buf, long len) {
+	long fileSize = size(fd);
+	if(fileSize < 0 || offset < 0) return -1;
+	len = minLong(len, fileSize - offset);
+	long done = 0;
+	while(done < len) {
+		long contiguous;
+		long addr = fileAddress(dir[fd], offset + done, &contiguous);
+		long n = minLong(contiguous, len - done);
+		leveler.readBytes(addr, (uint8_t*)buf + done, n);
+		done += n;
+	}
+	return done < 0 ? 0 : done;
+}
+
+
+int FlashFS::truncate(int fd, long newSize) {
+	long fileSize = size(fd);
+	if(fileSize < 0 || newSize < 0 || newSize > fileSize) return -1;
+	flashfs_entry_t& entry = dir[fd];
+
+	//room for the discards of all extents and the last block
+	if(discardCount + FLASHFS_MAX_EXTENTS + 1 > FLASHFS_MAX_DISCARDS) sync();
+
+	//free the blocks after the new end, the leveler doesn't need to keep them. They get discarded after the
+	//directory without them is written, so a power loss before the sync() keeps the old file
+	long keep = (newSize + blockSize - 1) / blockSize;
+	int e;
+	for(e=0; e<FLASHFS_MAX_EXTENTS; e++) {
+		flashfs_extent_t& ext = entry.extents[e];
+		if(keep >= ext.count) {
+			keep -= ext.count;
+			continue;
+		}
+		deferDiscard((ext.start + keep) * blockSize, (ext.count - keep) * blockSize);
+		ext.count = keep;
+		if(keep == 0) ext.start = 0;
+		keep = 0;
+	}
+	if(newSize % blockSize != 0 && newSize < fileSize) {
+		long contiguous;
+		long addr = fileAddress(entry, newSize, &contiguous);
+		deferDiscard(addr, minLong(contiguous, fileSize - newSize));
+		partialDiscard = true;
+	}
+	entry.size = newSize;
+	dirDirty = true;
+	return 0;
+}
+
+
+int FlashFS::unlink(const char* name) {
+	int fd = find(name);
+	if(fd < 0) return -1;
+	truncate(fd, 0);
+	memset(&dir[fd], 0, sizeof(dir[fd]));
+	dirDirty = true;
+	return 0;
+}
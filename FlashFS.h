@@ -0,0 +1,75 @@
+#ifndef _FLASHFS_H_
+#define _FLASHFS_H_
+
+#include <inttypes.h>
+#include "FlashWearLeveler.h"
+
+#define FLASHFS_MAX_FILES 16
+#define FLASHFS_MAX_EXTENTS 4
+#define FLASHFS_NAME_LENGTH 12
+//ranges freed by truncate() and unlink(), which wait for the next sync()
+#define FLASHFS_MAX_DISCARDS (2 * (FLASHFS_MAX_EXTENTS + 1))
+
+//a run of virtual blocks
+struct flashfs_extent_t {
+	uint16_t start;
+	uint16_t count;
+};
+
+struct flashfs_entry_t {
+	//zero terminated, unless all FLASHFS_NAME_LENGTH chars are used. Empty for unused entries
+	char name[FLASHFS_NAME_LENGTH];
+	uint32_t size;
+	flashfs_extent_t extents[FLASHFS_MAX_EXTENTS];
+};
+
+//small file layer on top of the wear leveler
+//files are allocated in whole virtual blocks, as up to FLASHFS_MAX_EXTENTS runs of blocks
+//the directory lives in the first virtual block and is cached in RAM. Changes to it are only
+//written by sync(), so appends don't bounce the leveler's active block between data and directory.
+//Data appended after the last sync() is lost on power loss. Freed blocks are only discarded, once sync() wrote
+//the directory, which doesn't reference them anymore. Until then they aren't reused.
+class FlashFS {
+public:
+	FlashFS(FlashWearLevelerBase& leveler);
+	//reads the directory. Returns false if there is no file system
+	bool mount();
+	//creates an empty file system
+	bool format();
+	//writes the directory, if it changed, and flushes the leveler. -1, if the leveler couldn't write
+	int sync();
+
+	//all functions return negative values on errors
+	//opens the file and truncates it, creates it if needed. Returns a file descriptor
+	int create(const char* name);
+	int open(const char* name);
+	//-1, if the data doesn't fit or the leveler can't take it
+	long append(int fd, const void* buf, long len);
+	//returns the number of bytes read, which is less than len at the end of the file
+	long read(int fd, long offset, void* buf, long len);
+	int truncate(int fd, long size);
+	int unlink(const char* name);
+	long size(int fd);
+	//directory entry of the file descriptor, 0 if it isn't in use. File descriptors are 0..FLASHFS_MAX_FILES-1
+	const flashfs_entry_t* stat(int fd);
+protected:
+	int find(const char* name);
+	bool isBlockFree(uint16_t block);
+	bool reserve(flashfs_entry_t& entry, long blocks);
+	long fileAddress(const flashfs_entry_t& entry, long pos, long* contiguous);
+	void deferDiscard(long addr, long len);
+
+	FlashWearLevelerBase& leveler;
+	flashfs_entry_t dir[FLASHFS_MAX_FILES];
+	bool dirDirty;
+	//virtual address ranges to discard after the directory is written
+	long discardAddr[FLASHFS_MAX_DISCARDS];
+	long discardLen[FLASHFS_MAX_DISCARDS];
+	int discardCount;
+	//one of them is a part of a block, which a file still uses
+	bool partialDiscard;
+	long blockSize;
+	uint16_t blockTotal;
+};
+
+#endif
@@ -0,0 +1,132 @@
+#include "FlashLZ.h"
+#include <string.h>
+
+#define HASH_BITS 8
+#define MAX_OFFSET 8192
+#define MAX_LITERALS 32
+#define MAX_MATCH (7 + 255 + 2)
+
+static inline uint16_t hash(const uint8_t* p) {
+	uint32_t v = ((uint32_t)p[0] << 16) | ((uint16_t)p[1] << 8) | p[2];
+	return (uint16_t)((uint32_t)(v * 2654435761UL) >> (32 - HASH_BITS));
+}
+
+
+int flashlz_compress(const uint8_t* in, int inLen, uint8_t* out, int outMax) {
+	//positions + 1 of the last occurrence of a hash, 0 = none
+	uint16_t htab[1 << HASH_BITS];
+	memset(htab, 0, sizeof(htab));
+
+	const uint8_t* ip = in;
+	const uint8_t* end = in + inLen;
+	uint8_t* op = out;
+	uint8_t* oend = out + outMax;
+
+	//the control byte of the current literal run is written, when the run ends
+	int literals = 0;
+	uint8_t* literalCtrl = op++;
+	if(op > oend) return 0;
+
+	while(ip < end) {
+		const uint8_t* ref = 0;
+		if(ip + 2 < end) {
+			uint16_t h = hash(ip);
+			if(htab[h]) ref = in + htab[h] - 1;
+			htab[h] = ip - in + 1;
+		}
+
+		if(ref && ip - ref <= MAX_OFFSET && ref[0] == ip[0] && ref[1] == ip[1] && ref[2] == ip[2]) {
+			int maxLen = end - ip;
+			if(maxLen > MAX_MATCH) maxLen = MAX_MATCH;
+			int len = 3;
+			while(len < maxLen && ref[len] == ip[len]) len++;
+			int off = ip - ref - 1;
+
+			//close the literal run, or drop its unused control byte
+			if(literals) {
+				*literalCtrl = literals - 1;
+			} else {
+				op--;
+			}
+			if(op + 3 + 1 > oend) return 0;
+			int l = len - 2;
+			if(l < 7) {
+				*op++ = (off >> 8) | (l << 5);
+			} else {
+				*op++ = (off >> 8) | (7 << 5);
+				*op++ = l - 7;
+			}
+			*op++ = off;
+			ip += len;
+
+			literals = 0;
+			literalCtrl = op++;
+		} else {
+			if(op >= oend) return 0;
+			*op++ = *ip++;
+			if(++literals == MAX_LITERALS) {
+				*literalCtrl = MAX_LITERALS - 1;
+				literals = 0;
+				literalCtrl = op++;
+				if(op > oend) return 0;
+			}
+		}
+	}
+
+	if(literals) {
+		*literalCtrl = literals - 1;
+	} else {
+		op--;
+	}
+	return op - out;
+}
+
+
+int flashlz_decompress(const uint8_t* in, int inLen, uint8_t* out, int outMax) {
+	int used;
+	int len = flashlz_decompress_part(in, inLen, &used, out, 0, outMax);
+	return used == inLen ? len : -1;
+}
+
+
+int flashlz_decompress_part(const uint8_t* in, int inLen, int* inUsed, uint8_t* out, int outPos, int outMax) {
+	const uint8_t* ip = in;
+	const uint8_t* iend = in + inLen;
+	uint8_t* op = out + outPos;
+	uint8_t* oend = out + outMax;
+
+	while(ip < iend) {
+		uint8_t ctrl = *ip;
+		//the sequence continues in the next part
+		int seqLen = ctrl < MAX_LITERALS ? ctrl + 2 : (ctrl >> 5) == 7 ? 3 : 2;
+		if(ip + seqLen > iend) break;
+		ip++;
+		if(ctrl < MAX_LITERALS) {
+			int n = ctrl + 1;
+			if(op + n > oend) {
+				*inUsed = ip - in;
+				return -1;
+			}
+			memcpy(op, ip, n);
+			op += n;
+			ip += n;
+		} else {
+			int len = ctrl >> 5;
+			if(len == 7) {
+				len += *ip++;
+			}
+			len += 2;
+			const uint8_t* ref = op - (((ctrl & 0x1f) << 8) | *ip++) - 1;
+			if(ref < out || op + len > oend) {
+				*inUsed = ip - in;
+				return -1;
+			}
+			//the regions may overlap, so copy byte wise
+			while(len--) {
+				*op++ = *ref++;
+			}
+		}
+	}
+	*inUsed = ip - in;
+	return op - out;
+}
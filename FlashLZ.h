@@ -0,0 +1,23 @@
+#ifndef _FLASHLZ_H_
+#define _FLASHLZ_H_
+
+#include <inttypes.h>
+
+//small LZ77 codec (LZF style) for compressing flash blocks on MCUs
+//compression needs 512 bytes of stack for the hash table, decompression no extra memory
+//
+//the stream is a sequence of
+//  000LLLLL                      literal run of L+1 bytes, which follow
+//  LLLooooo oooooooo             back reference of L+2 bytes at distance o+1
+//  111ooooo LLLLLLLL oooooooo    back reference of L+9 bytes at distance o+1
+
+//returns the compressed size, or 0 if the result doesn't fit into outMax bytes
+int flashlz_compress(const uint8_t* in, int inLen, uint8_t* out, int outMax);
+//returns the decompressed size, or -1 if the input is corrupt or doesn't fit into outMax bytes
+int flashlz_decompress(const uint8_t* in, int inLen, uint8_t* out, int outMax);
+//decompresses the complete sequences of in behind the outPos bytes already in out, for input that arrives in parts.
+//inUsed is set to the bytes consumed, the rest starts a sequence, which continues in the next part. Returns the new
+//decompressed size, or -1 if the input is corrupt or doesn't fit into outMax bytes
+int flashlz_decompress_part(const uint8_t* in, int inLen, int* inUsed, uint8_t* out, int outPos, int outMax);
+
+#endif
@@ -0,0 +1,74 @@
+#include "FlashPartition.h"
+#include <string.h>
+
+//"FPT1"
+#define FLASH_PARTITION_MAGIC 0x31545046UL
+//the table itself
+#define TABLE_BLOCKS 1
+
+
+FlashPartitionTable::FlashPartitionTable() {
+	clear();
+}
+
+
+void FlashPartitionTable::clear() {
+	memset(&table, 0, sizeof(table));
+	table.magic = FLASH_PARTITION_MAGIC;
+}
+
+
+const flash_partition_t* FlashPartitionTable::add(const char* name, uint32_t blockCount) {
+	if(table.count == FLASH_PARTITION_MAX || name[0] == 0 || blockCount == 0 || find(name) != 0) {
+		return 0;
+	}
+	flash_partition_t& p = table.partitions[table.count];
+	strncpy(p.name, name, FLASH_PARTITION_NAME_LENGTH);
+	p.firstBlock = getBlockCount();
+	p.blockCount = blockCount;
+	table.count++;
+	return &p;
+}
+
+
+const flash_partition_t* FlashPartitionTable::find(const char* name) {
+	uint32_t i;
+	for(i=0; i<table.count; i++) {
+		if(strncmp(table.partitions[i].name, name, FLASH_PARTITION_NAME_LENGTH) == 0) {
+			return &table.partitions[i];
+		}
+	}
+	return 0;
+}
+
+
+int FlashPartitionTable::getCount() {
+	return table.count;
+}
+
+
+const flash_partition_t* FlashPartitionTable::get(int i) {
+	if(i < 0 || i >= (int)table.count) return 0;
+	return &table.partitions[i];
+}
+
+
+uint32_t FlashPartitionTable::getBlockCount() {
+	if(table.count == 0) return TABLE_BLOCKS;
+	const flash_partition_t& last = table.partitions[table.count - 1];
+	return last.firstBlock + last.blockCount;
+}
+
+
+//the partitions have to follow each other without gaps or overlaps
+bool FlashPartitionTable::isValid() {
+	if(table.magic != FLASH_PARTITION_MAGIC || table.count > FLASH_PARTITION_MAX) return false;
+	uint32_t next = TABLE_BLOCKS;
+	uint32_t i;
+	for(i=0; i<table.count; i++) {
+		const flash_partition_t& p = table.partitions[i];
+		if(p.name[0] == 0 || p.firstBlock != next || p.blockCount == 0) return false;
+		next += p.blockCount;
+	}
+	return true;
+}
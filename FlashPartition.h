@@ -0,0 +1,69 @@
+#ifndef _FLASHPARTITION_H_
+#define _FLASHPARTITION_H_
+
+#include <inttypes.h>
+
+#define FLASH_PARTITION_MAX 8
+#define FLASH_PARTITION_NAME_LENGTH 12
+
+struct flash_partition_t {
+	//zero terminated, unless all FLASH_PARTITION_NAME_LENGTH chars are used
+	char name[FLASH_PARTITION_NAME_LENGTH];
+	//in 4k blocks from the start of the chip
+	uint32_t firstBlock;
+	uint32_t blockCount;
+};
+
+struct flash_partition_table_t {
+	uint32_t magic;
+	uint32_t count;
+	flash_partition_t partitions[FLASH_PARTITION_MAX];
+};
+
+//table of the partitions on one chip, stored in its first 4k block. The partitions follow it back to back.
+//Each partition gets its own FlashWearLeveler, which starts at the first block of the partition:
+//  FlashPartitionTable table;
+//  if(!table.read(flash)) {
+//    table.add("config", 8);
+//    table.add("log", 200);
+//    table.write(flash);
+//  }
+//  FlashWearLeveler<SPIFlash, 8> config(flash, table.find("config")->firstBlock);
+//  FlashWearLeveler<SPIFlash, 200> log(flash, table.find("log")->firstBlock);
+//Hot partitions only wear their own blocks. The levelers share the flash, their stats count their own accesses
+class FlashPartitionTable {
+public:
+	FlashPartitionTable();
+	void clear();
+	//appends a partition behind the last one. Returns 0, if the table is full or the name is taken
+	const flash_partition_t* add(const char* name, uint32_t blockCount);
+	const flash_partition_t* find(const char* name);
+	int getCount();
+	const flash_partition_t* get(int i);
+	//blocks of the table and all partitions
+	uint32_t getBlockCount();
+
+	//returns false, if there is no table on the flash
+	template<typename Flash>
+	bool read(Flash& flash) {
+		flash.readBytes(0, &table, sizeof(table));
+		if(isValid()) return true;
+		clear();
+		return false;
+	}
+	//returns false, if the partitions don't fit on the flash. A flash of unknown size (capacity 0) isn't checked
+	template<typename Flash>
+	bool write(Flash& flash) {
+		long capacity = flash.getCapacity();
+		if(capacity != 0 && (long)getBlockCount() * 4096 > capacity) return false;
+		flash.blockErase4K(0);
+		flash.writeBytes(0, &table, sizeof(table));
+		return true;
+	}
+protected:
+	bool isValid();
+
+	flash_partition_table_t table;
+};
+
+#endif
@@ -0,0 +1,78 @@
+#include "FlashTrace.h"
+#include <string.h>
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <stdio.h>
+#include <time.h>
+#endif
+
+static const char* const opNames[FT_OP_COUNT] = {
+	"init", "format", "readByte", "read", "writeByte", "write", "discard", "flush",
+	"txBegin", "txCommit", "txAbort", "snapshot", "sleep",
+	"activate", "writeBlock", "skipFlush", "release", "relocate", "recoverJournal", "recoverDeleted", "hold", "erase"
+};
+
+const char* flashTraceOpName(uint16_t op) {
+	return op < FT_OP_COUNT ? opNames[op] : "?";
+}
+
+#ifdef FWL_TRACE
+
+static FlashTraceEvent traceBuffer[FWL_TRACE_SIZE];
+//events recorded since the last clear
+static uint32_t traceCount;
+//events already read
+static uint32_t traceRead;
+
+static uint32_t traceTime() {
+#ifdef ARDUINO
+	return micros();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000000UL + ts.tv_nsec / 1000);
+#endif
+}
+
+void flashTrace(uint16_t op, uint32_t block, uint32_t addr, uint32_t len) {
+	FlashTraceEvent& e = traceBuffer[traceCount % FWL_TRACE_SIZE];
+	e.time = traceTime();
+	e.addr = addr;
+	e.len = len;
+	e.block = block;
+	e.op = op;
+	traceCount++;
+}
+
+uint32_t flashTraceLost() {
+	return traceCount - traceRead > FWL_TRACE_SIZE ? traceCount - traceRead - FWL_TRACE_SIZE : 0;
+}
+
+int flashTraceRead(FlashTraceEvent* events, int max) {
+	traceRead += flashTraceLost();
+	int n = 0;
+	while(n < max && traceRead != traceCount) {
+		events[n++] = traceBuffer[traceRead++ % FWL_TRACE_SIZE];
+	}
+	return n;
+}
+
+void flashTraceClear() {
+	traceCount = 0;
+	traceRead = 0;
+}
+
+#ifndef ARDUINO
+bool flashTraceSave(const char* fileName) {
+	FILE* f = fopen(fileName, "wb");
+	if(!f) return false;
+	FlashTraceEvent e;
+	while(flashTraceRead(&e, 1) == 1) {
+		fwrite(&e, sizeof(e), 1, f);
+	}
+	return fclose(f) == 0;
+}
+#endif
+
+#endif
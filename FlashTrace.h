@@ -0,0 +1,72 @@
+#ifndef _FLASHTRACE_H_
+#define _FLASHTRACE_H_
+
+#include <inttypes.h>
+
+//tracing of the wear leveler into a RAM ring buffer
+//without FWL_TRACE the trace points compile to nothing. Define it here or with -DFWL_TRACE for all files
+//#define FWL_TRACE
+
+//number of events kept, 20 bytes each
+#ifndef FWL_TRACE_SIZE
+#define FWL_TRACE_SIZE 64
+#endif
+
+enum FlashTraceOp {
+	//calls of the leveler api, a trace of them can be replayed
+	FT_INIT,           //block = number of blocks
+	FT_FORMAT,
+	FT_READ_BYTE,      //addr = virtual address
+	FT_READ,           //addr, len
+	FT_WRITE_BYTE,     //addr
+	FT_WRITE,          //addr, len
+	FT_DISCARD,        //addr, len
+	FT_FLUSH,          //block = active virtual block
+	FT_TX_BEGIN,
+	FT_TX_COMMIT,      //len = durable
+	FT_TX_ABORT,
+	FT_SNAPSHOT,       //len = 1 taken, 0 released
+	FT_SLEEP,
+	//what the leveler does internally
+	FT_ACTIVATE,       //block = virtual block, addr = physical block
+	FT_WRITE_BLOCK,    //block = virtual block, addr = physical block, len = bytes programmed
+	FT_SKIP_FLUSH,     //block = virtual block
+	FT_RELEASE,        //addr = physical block
+	FT_RELOCATE,       //block = virtual block
+	FT_RECOVER_JOURNAL,//addr = physical block, len = entries, block = 1 if committed
+	FT_RECOVER_DELETED,//addr = physical block
+	FT_HOLD,           //block = virtual block, addr = physical block kept for the snapshot
+	FT_ERASE,          //addr = physical block
+	FT_OP_COUNT
+};
+
+struct FlashTraceEvent {
+	//micros()
+	uint32_t time;
+	uint32_t addr;
+	uint32_t len;
+	//virtual block, 32 bit for FWL_WIDE_HEADERS
+	uint32_t block;
+	uint16_t op;
+};
+
+const char* flashTraceOpName(uint16_t op);
+
+#ifdef FWL_TRACE
+void flashTrace(uint16_t op, uint32_t block, uint32_t addr, uint32_t len);
+//copies up to max events out of the ring buffer, oldest first. Returns the number of events copied
+int flashTraceRead(FlashTraceEvent* events, int max);
+//number of events, which were overwritten before they got read
+uint32_t flashTraceLost();
+void flashTraceClear();
+#ifndef ARDUINO
+//writes the buffered events as raw FlashTraceEvents, for the tools/tracedump and tools/tracereplay
+bool flashTraceSave(const char* fileName);
+#endif
+
+#define FWL_TRACE_EVENT(op, block, addr, len) flashTrace(op, block, addr, len)
+#else
+#define FWL_TRACE_EVENT(op, block, addr, len)
+#endif
+
+#endif
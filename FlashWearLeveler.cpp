@@ -1,4 +1,7 @@
 #include "FlashWearLeveler.h"
+#include "FlashLZ.h"
+#include "FlashTrace.h"
+#include "FlashCRC.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -6,24 +9,71 @@
 
 #ifdef ARDUINO
 #include <Arduino.h>
+#else
+#include <time.h>
 #endif
 
-#define BLOCK_NOT_DELETED_BIT (1<<15)
+//block headers are 16 bit, or 32 bit with FWL_WIDE_HEADERS. The top bit is the not deleted bit
+#define HEADER_SIZE ((int)sizeof(fwl_block_t))
+#define BLOCK_NOT_DELETED_BIT ((fwl_block_t)1 << (HEADER_SIZE*8 - 1))
+//the block data is compressed. Only set in the header on flash and in blockHeaderCache, never in the activeBlock
+#define BLOCK_COMPRESSED_BIT ((fwl_block_t)1 << (HEADER_SIZE*8 - 2))
 
-//masks the last 14bits. the first two bits are reserved as flags
-#define BLOCK_ID(v) ((v) & 0x3fff)
+//masks the last 14 (30) bits. the first two bits are reserved as flags
+#define BLOCK_ID_MASK (BLOCK_COMPRESSED_BIT - 1)
+#define BLOCK_ID(v) ((v) & BLOCK_ID_MASK)
 
-//block is deleted, if bit 15 is 0. This
-#define BLOCK_DELETED(v) ( !((v) & (1<<15)) )
-//block is free, if it is either 0xffff or the deleted bit is 0
-#define BLOCK_IS_FREE(v) ((v) == 0xffff || !( (v) & (1<<15) ) )
+//block is deleted, if the top bit is 0
+#define BLOCK_DELETED(v) ( !((v) & BLOCK_NOT_DELETED_BIT) )
+//block is free, if it is either erased (all ones) or the deleted bit is 0
+#define BLOCK_IS_FREE(v) ((v) == ErasedHeader || BLOCK_DELETED(v))
 
-#define VIRTUAL_BLOCK_SIZE 4094
 #define PHYSICAL_BLOCK_SIZE 4096
+//the trailer is at the end of the programmed bytes: at the end of the block or behind the compressed data
+#define VIRTUAL_BLOCK_SIZE (PHYSICAL_BLOCK_SIZE - HEADER_SIZE - FWL_TRAILER_SIZE)
+
+//every flush adds HEAT_INCREMENT to the heat of the block, every blockCount flushes all heats get halved
+#define HEAT_INCREMENT 32
+//a block flushed about twice per blockCount flushes is hot
+#define HOT_THRESHOLD 64
+//look for a cold block to relocate every n hot flushes
+#define RELOCATE_INTERVAL 8
+//minimum difference in erase counts, before maintenance() moves cold data
+#define RELOCATE_MIN_SPREAD 4
+//the same for the moves after hot flushes. A move costs an erase, below this spread the placement of the flushed
+//blocks levels the wear without one
+#define RELOCATE_FLUSH_SPREAD 32
+//virtual blocks looked at per search for a cold block, so that big flashes don't pay a full scan
+#define RELOCATE_WINDOW 256
+//with hot/cold separation the best of the next n free blocks is used
+#define FREE_CANDIDATES 64
+//expected duration of the first migration by maintenance(): erasing and programming a 4k block.
+//Afterwards the measured durations are used
+#define MIGRATION_ESTIMATE 60000UL
+
+//where findFreeBlock() puts a block: the next free block, the least worn (hot data) or the most worn (cold data)
+enum { PLACE_NEXT, PLACE_HOT, PLACE_COLD };
+
+//a compressed block is stored as header, uint16_t length, the compressed data and the trailer. It is only written
+//compressed, if that saves at least one page
+#define FLASH_PAGE_SIZE 256
+#define COMPRESSED_HEADER_SIZE (HEADER_SIZE + 2)
+#define COMPRESSED_MAX_SIZE (PHYSICAL_BLOCK_SIZE - FLASH_PAGE_SIZE - COMPRESSED_HEADER_SIZE - FWL_TRAILER_SIZE)
+
+//the journal of a transaction is a physical block with this header, followed by (virtual block, physical block) pairs
+//for every block written. The blocks are published, once the commit record is written
+#define JOURNAL_HEADER (BLOCK_NOT_DELETED_BIT | (BLOCK_ID_MASK - 1))
+#define JOURNAL_COMMIT BLOCK_ID_MASK
+#define JOURNAL_MAX_ENTRIES ((PHYSICAL_BLOCK_SIZE - HEADER_SIZE) / (2*HEADER_SIZE))
+
+//blockHeaderCache entry of a block, which is only kept for the snapshot. On flash it is marked as deleted
+#define HELD_HEADER (BLOCK_NOT_DELETED_BIT | (BLOCK_ID_MASK - 2))
+
+enum { TX_NONE, TX_OPEN, TX_PENDING };
 
 //represents an address as block index and offset into the block
 struct addr_info_ {
-	uint16_t block;
+	fwl_block_t block;
 	uint16_t offset;
 
 	inline bool operator == (const addr_info_ &b) const {
@@ -35,15 +85,13 @@ struct addr_info_ {
 	}
 };
 
-const uint16_t ErasedHeader = 0xffff;
+const fwl_block_t ErasedHeader = (fwl_block_t)~(fwl_block_t)0;
 
+//only for errors, everything else goes to the trace (see FlashTrace.h)
 #ifdef ARDUINO
 #define FWL_ERR(...) Serial.printf(__VA_ARGS__); Serial.println(""); Serial.flush();
-//#define FWL_DBG(...) Serial.printf(__VA_ARGS__); Serial.println("");
-#define FWL_DBG(...)
 #else
 #define FWL_ERR(...) printf(__VA_ARGS__); printf("\n");
-#define FWL_DBG(...) printf(__VA_ARGS__); printf("\n"); delay(10);
 #endif
 
 static addr_info SplitVirtualAddress(long addr) {
@@ -58,11 +106,11 @@ static addr_info SplitPhysicalAddress(long addr) {
 	addr_info res;
 	res.block = addr/PHYSICAL_BLOCK_SIZE;
 	res.offset = addr - res.block*PHYSICAL_BLOCK_SIZE;
-	if(res.offset < 2) {
+	if(res.offset < HEADER_SIZE) {
 		FWL_ERR("Can't split physical address %08lx. It is not in the mapped area", addr);
 	}
 	//subtract the header
-	res.offset -= 2;
+	res.offset -= HEADER_SIZE;
 	return res;
 }
 
@@ -72,16 +120,62 @@ static long CombineVirtualAddress(addr_info info) {
 
 static long CombinePhysicalAddress(addr_info info) {
 	//add the header
-	return (long)info.block * PHYSICAL_BLOCK_SIZE + info.offset + 2;
+	return (long)info.block * PHYSICAL_BLOCK_SIZE + info.offset + HEADER_SIZE;
+}
+
+//stores the checksum of the len programmed bytes (without the header) behind them. Returns the length with the trailer
+static int appendTrailer(uint8_t* block, int len) {
+#ifdef FWL_BLOCK_CRC
+	uint32_t crc = flashcrc32(0, block + HEADER_SIZE, len - HEADER_SIZE);
+	memcpy(block + len, &crc, sizeof(crc));
+#else
+	(void)block;
+#endif
+	return len + FWL_TRAILER_SIZE;
+}
+
+static bool trailerMatches(const uint8_t* block, int len) {
+#ifdef FWL_BLOCK_CRC
+	uint32_t crc;
+	memcpy(&crc, block + len, sizeof(crc));
+	return crc == flashcrc32(0, block + HEADER_SIZE, len - HEADER_SIZE);
+#else
+	(void)block;
+	(void)len;
+	return true;
+#endif
 }
 
 
 
-FlashWearLevelerBase::FlashWearLevelerBase(uint16_t noOf4kBlocks, uint16_t* blockMapMem, uint16_t* blockHeaderCacheMem):
-		blockCount(noOf4kBlocks), blockMap(blockMapMem), blockHeaderCache(blockHeaderCacheMem)
+FlashWearLevelerBase::FlashWearLevelerBase(fwl_block_t noOf4kBlocks, fwl_block_t* blockMapMem, fwl_block_t* blockHeaderCacheMem,
+		uint8_t* blockHeatMem, uint16_t* blockLastFlushMem, uint16_t* eraseCountMem, uint8_t* compressBufferMem,
+		uint32_t* freeMapMem, long _flashOffset):
+		blockCount(noOf4kBlocks), blockMap(blockMapMem), blockHeaderCache(blockHeaderCacheMem),
+		blockHeat(blockHeatMem), blockLastFlush(blockLastFlushMem), flushSequence(0), flushesSinceRelocation(0),
+		eraseCount(eraseCountMem), relocateCursor(0), migrationMicros(MIGRATION_ESTIMATE), flashOffset(_flashOffset),
+		freeMap(freeMapMem), freeMapWords((noOf4kBlocks + 31) / 32),
+		unownedMap(freeMapMem ? freeMapMem + FWL_BITMAP_WORDS(noOf4kBlocks) : 0),
+		unmappedMap(freeMapMem ? freeMapMem + FWL_BITMAP_WORDS(noOf4kBlocks) * 2 : 0),
+		heldMap(freeMapMem ? freeMapMem + FWL_BITMAP_WORDS(noOf4kBlocks) * 3 : 0),
+		erasedMap(freeMapMem ? freeMapMem + FWL_BITMAP_WORDS(noOf4kBlocks) * 4 : 0), erasedMapValid(false),
+		compression(compressBufferMem != 0), compressBuffer(compressBufferMem),
+		compressBufferBlock(ErasedHeader), verifyOnActivation(false), verifyOnMount(false)
 {
 	assert(blockMap != 0);
 	assert(blockHeaderCache != 0);
+	hotColdSeparation = blockHeat != 0 && blockLastFlush != 0 && eraseCount != 0;
+	if(hotColdSeparation) {
+		memset(blockHeat, 0, blockCount * sizeof(uint8_t));
+		memset(blockLastFlush, 0, blockCount * sizeof(uint16_t));
+		memset(eraseCount, 0, blockCount * sizeof(uint16_t));
+	}
+	resetStats();
+	endTransaction();
+	snapshot = 0;
+	snapshotReserve = 0;
+	freeBlocks = 0;
+	discardedCount = 0;
 }
 
 
@@ -90,31 +184,79 @@ FlashWearLevelerBase::~FlashWearLevelerBase() {
 
 
 bool FlashWearLevelerBase::initialize() {
-	FWL_DBG("WearLeveler start init...");
+	FWL_TRACE_EVENT(FT_INIT, blockCount, 0, 0);
+	long size = flashSize();
+	if(size != 0 && flashOffset + (long)blockCount * PHYSICAL_BLOCK_SIZE > size) {
+		FWL_ERR("Flash is too small for %li blocks", (long)blockCount);
+		return false;
+	}
+	//the highest ids are the journal and held markers
+	if(blockCount > BLOCK_ID_MASK - 2) {
+		FWL_ERR("%li blocks need FWL_WIDE_HEADERS", (long)blockCount);
+		return false;
+	}
 	//if(!flashinitialize()) return false;
+	erasedMapValid = false;
+	compressBufferBlock = ErasedHeader;
+	discardedCount = 0;
 	activeBlockDirty = false;
+	endTransaction();
+	//held blocks are marked as deleted on flash and become free below
+	snapshot = 0;
+	snapshotReserve = 0;
 
 	//clean the current block cache
 	memset(activeBlock, 0xFF, PHYSICAL_BLOCK_SIZE);
 
+	fwl_block_t i;
+	fwl_block_t journal = ErasedHeader;
+	for(i=0; i<blockCount; i++) {
+		blockHeaderCache[i] = readBlockHeader(i);
+		//every block with data has a header, the first thing programmed
+		setErased(i, blockHeaderCache[i] == ErasedHeader);
+		if(blockHeaderCache[i] == JOURNAL_HEADER) {
+			journal = i;
+		}
+	}
+	//finish or roll back a transaction, which was interrupted
+	if(journal != ErasedHeader) {
+		recoverJournal(journal);
+	}
+
 	//initialize the map with ff (unused)
-	memset(blockMap, 0xFF, blockCount * sizeof(uint16_t));
+	memset(blockMap, 0xFF, blockCount * sizeof(fwl_block_t));
 
 	//iterate through the physical blocks to fill the block map
-	int i;
 	for(i=0; i<blockCount; i++) {
-		uint16_t virtualBlockId = readBlockHeader(i);
-		blockHeaderCache[i] = virtualBlockId;
-		if(virtualBlockId != 0xffff) {
-			if(BLOCK_ID(virtualBlockId) > blockCount) {
+		fwl_block_t virtualBlockId = blockHeaderCache[i];
+		if(virtualBlockId != ErasedHeader) {
+			if(BLOCK_DELETED(virtualBlockId)) {
+				//released blocks are erased, when they get reused
+				if(erasedMap == 0) {
+					FWL_TRACE_EVENT(FT_RECOVER_DELETED, BLOCK_ID(virtualBlockId), i, 0);
+					//the power went off between marking the block as deleted and erasing it
+					eraseBlock(i);
+				}
+				continue;
+			}
+
+			if(BLOCK_ID(virtualBlockId) >= blockCount) {
 				FWL_ERR("Block id > blockCount. You should format the flash");
 				return false;
 			}
 
-			if(BLOCK_DELETED(virtualBlockId)) {
-				FWL_ERR("Found deleted block (0x%x). Deleting...", virtualBlockId);
-				//flashblockErase4K(i*4096);
-				continue;
+			fwl_block_t other = blockMap[BLOCK_ID(virtualBlockId)];
+			if(verifyOnMount && other != ErasedHeader) {
+				//the power went off after writing the block again, but before releasing the old copy
+				//one copy may be torn. Without a mismatch either copy is complete and, as without verification, the one
+				//with the higher physical index is kept. That's not the newer one, if the allocation wrapped around
+				fwl_block_t stale = BLOCK_ID(other);
+				if(!verifyBlock(i) && verifyBlock(stale)) {
+					stale = i;
+				}
+				releasePhysicalBlock(stale | BLOCK_NOT_DELETED_BIT);
+				setBlockHeader(stale, blockHeaderCache[stale] & ~BLOCK_NOT_DELETED_BIT);
+				if(stale == i) continue;
 			}
 
 			//mark as NOT deleted by setting the not deleted bit
@@ -123,22 +265,21 @@ bool FlashWearLevelerBase::initialize() {
 	}
 
 	//now iterate over the virtual blocks to fill the holes
-	int lastFreePhysicalBlock = 0;
+	fwl_block_t lastFreePhysicalBlock = 0;
 	for(i=0; i<blockCount; i++) {
 		//if it is marked as free, lets assign a physical block
-		if(blockMap[i] == 0xffff) {
+		if(blockMap[i] == ErasedHeader) {
 
-			int y;
 			//find a free physical block and assign it to this virtual one
 			for( ; lastFreePhysicalBlock<blockCount; lastFreePhysicalBlock++) {
-				//uint16_t header = readBlockHeader(lastFreePhysicalBlock);
-				uint16_t header = blockHeaderCache[lastFreePhysicalBlock];
+				//fwl_block_t header = readBlockHeader(lastFreePhysicalBlock);
+				fwl_block_t header = blockHeaderCache[lastFreePhysicalBlock];
 				if(BLOCK_IS_FREE(header)) {
 					//sucessfully filled hole
 					//the deleted bit is automatically zero, which is correct
 					blockMap[i] = lastFreePhysicalBlock;
 					//now we know the virtualBlock, this block got assigned to, so we can update the value
-					blockHeaderCache[lastFreePhysicalBlock] = i;
+					setBlockHeader(lastFreePhysicalBlock, i);
 					break;
 				}
 			}
@@ -153,19 +294,43 @@ bool FlashWearLevelerBase::initialize() {
 		}
 	}
 
-	FWL_DBG("WearLeveler initialized...");
+	rebuildFreeMap();
+	erasedMapValid = erasedMap != 0;
 	printCaches();
 	return true;
 }
 
+//only erases the blocks, which aren't erased yet. A chip erase is used, if most of them aren't and the leveler
+//covers the whole flash. After initialize() the erased bitmap is known, otherwise the blocks get blank checked
 bool FlashWearLevelerBase::format() {
-	flashChipErase();
-
-	/*FWL_DBG("read %i", (int)flashReadByte(10));
-	FWL_DBG("read %i", (int)flashReadByte(100));
-	FWL_DBG("read %i", (int)flashReadByte(1000));
-	FWL_DBG("read %i", (int)flashReadByte(5000));
-*/
+	FWL_TRACE_EVENT(FT_FORMAT, 0, 0, 0);
+	fwl_block_t dirty = blockCount;
+	fwl_block_t i;
+	if(erasedMap != 0) {
+		if(!erasedMapValid) {
+			for(i=0; i<blockCount; i++) {
+				setErased(i, isBlank(i));
+			}
+		}
+		dirty = 0;
+		for(i=0; i<blockCount; i++) {
+			if(!isErased(i)) dirty++;
+		}
+	}
+	long size = flashSize();
+	bool wholeFlash = flashOffset == 0 && (size == 0 || (long)blockCount * PHYSICAL_BLOCK_SIZE >= size);
+	if(dirty > blockCount / 2 && wholeFlash) {
+		flashChipErase();
+		stats.erases += blockCount;
+	} else {
+		for(i=0; i<blockCount; i++) {
+			if(erasedMap != 0) {
+				eraseIfDirty(i);
+			} else {
+				eraseBlock(i);
+			}
+		}
+	}
 	return initialize();
 }
 
@@ -188,10 +353,10 @@ void FlashWearLevelerBase::printCaches() {
 
 
 uint8_t FlashWearLevelerBase::readByte(long addr) {
-	FWL_DBG("Read byte %x", addr);
+	FWL_TRACE_EVENT(FT_READ_BYTE, 0, addr, 1);
 
 	addr_info info = SplitVirtualAddress(addr);
-	uint16_t h = getActiveBlockHeader();
+	fwl_block_t h = getActiveBlockHeader();
 	if(!BLOCK_IS_FREE(h)) {
 		//active block is valid, see, if we need to read from there
 
@@ -201,10 +366,25 @@ uint8_t FlashWearLevelerBase::readByte(long addr) {
 		}
 		if(info.block == BLOCK_ID(h)) {
 			//add the header
-			return activeBlock[info.offset+2];
+			return activeBlock[info.offset+HEADER_SIZE];
 		}
 	}
 
+	int d = findDiscardedRange(info.block);
+	if(d >= 0 && info.offset >= discardedStart[d] && info.offset < discardedEnd[d]) {
+		return 0xff;
+	}
+
+	if(isCompressed(info.block)) {
+		const uint8_t* data = decompressedBlock(BLOCK_ID(blockMap[info.block]));
+		return data ? data[info.offset] : 0xff;
+	}
+
+	if(BLOCK_IS_FREE(blockMap[info.block])) {
+		//never written or discarded, the free block may not be erased yet. During a transaction there may be none
+		return 0xff;
+	}
+
 	//just forward
 	addr_info physicalInfo;
 	physicalInfo.block = BLOCK_ID(blockMap[info.block]);
@@ -215,7 +395,7 @@ uint8_t FlashWearLevelerBase::readByte(long addr) {
 
 
 int FlashWearLevelerBase::readBytes(long addr, void* buf, long len) {
-	FWL_DBG("Read bytes %x %i", addr, len);
+	FWL_TRACE_EVENT(FT_READ, 0, addr, len);
 
 	//iterate over the blocks
 	addr_info start = SplitVirtualAddress(addr);
@@ -227,9 +407,7 @@ int FlashWearLevelerBase::readBytes(long addr, void* buf, long len) {
 
 	int status = 0;
 
-	int pos = 0;
 	while(start != end) {
-		long physicalAddress = CombinePhysicalAddress(start);
 		int len;
 		if(end.block > start.block) {
 			//copy the rest
@@ -251,21 +429,36 @@ int FlashWearLevelerBase::readBytes(long addr, void* buf, long len) {
 
 
 int FlashWearLevelerBase::readBytesFromVBlock(const addr_info& virtualStartInfo, void* buf, long len) {
-	FWL_DBG("Read bytes vblock %i %i", virtualStartInfo.offset + len, VIRTUAL_BLOCK_SIZE);
 	assert(virtualStartInfo.offset + len <= VIRTUAL_BLOCK_SIZE);
 	int status = 0;
-	uint16_t h = getActiveBlockHeader();
+	fwl_block_t h = getActiveBlockHeader();
 	//see if we need to copy from the active Block
 	if(!BLOCK_IS_FREE(h) && BLOCK_ID(h) == virtualStartInfo.block) {
-		memcpy(buf, activeBlock + virtualStartInfo.offset + 2, len);
+		memcpy(buf, activeBlock + virtualStartInfo.offset + HEADER_SIZE, len);
+	} else if(isCompressed(virtualStartInfo.block)) {
+		//there is no random access into compressed data
+		const uint8_t* data = decompressedBlock(BLOCK_ID(blockMap[virtualStartInfo.block]));
+		if(data == 0) return -1;
+		memcpy(buf, data + virtualStartInfo.offset, len);
+	} else if(BLOCK_IS_FREE(blockMap[virtualStartInfo.block])) {
+		//no data on flash
+		memset(buf, 0xFF, len);
 	} else {
 		addr_info physicalInfo;
 		physicalInfo.block = BLOCK_ID(blockMap[virtualStartInfo.block]);
 		physicalInfo.offset = virtualStartInfo.offset;
 		long a = CombinePhysicalAddress(physicalInfo);
-		FWL_DBG("read On Flash %i %i", a, len);
 		status = flashReadBytes(a, buf, len);
 	}
+	//only inactive blocks have a discarded range
+	int d = findDiscardedRange(virtualStartInfo.block);
+	if(d >= 0) {
+		long from = discardedStart[d] > virtualStartInfo.offset ? discardedStart[d] : virtualStartInfo.offset;
+		long to = discardedEnd[d] < virtualStartInfo.offset + len ? discardedEnd[d] : virtualStartInfo.offset + len;
+		if(from < to) {
+			memset((uint8_t*)buf + from - virtualStartInfo.offset, 0xFF, to - from);
+		}
+	}
 	return status;
 }
 
@@ -275,12 +468,14 @@ int FlashWearLevelerBase::writeByte(long addr, uint8_t byt) {
 	if(virtualInfo.block >= blockCount) {
 		FWL_ERR("Illegal block address %i", virtualInfo.block);
 	}
-	activateVirtualBlock(virtualInfo.block);
-
-	FWL_DBG("Write byte %i", addr);
+	FWL_TRACE_EVENT(FT_WRITE_BYTE, 0, addr, 1);
+	if(txState == TX_PENDING) {
+		//writes outside of a transaction must not become part of the deferred ones
+		if(!flushActiveBlock()) return -1;
+	}
+	if(!activateVirtualBlock(virtualInfo.block)) return -1;
 
-	activeBlock[virtualInfo.offset + 2] = byt;
-	activeBlockDirty = true;
+	updateActiveBlock(virtualInfo.offset, &byt, 1);
 	return 0;
 }
 
@@ -292,22 +487,25 @@ int FlashWearLevelerBase::writeBytes(long addr, const void* buf, int len) {
 	if(end.block >= blockCount) {
 		FWL_ERR("Illegal block address %i", end.block);
 	}
-	FWL_DBG("Write bytes");
+	FWL_TRACE_EVENT(FT_WRITE, 0, addr, len);
+	if(txState == TX_PENDING) {
+		if(!flushActiveBlock()) return -1;
+	}
 
 	while(start != end) {
-		activateVirtualBlock(start.block);
+		//the blocks before stay written
+		if(!activateVirtualBlock(start.block)) return -1;
 		if(end.block > start.block) {
 			//copy the rest
 			len = VIRTUAL_BLOCK_SIZE - start.offset;
-			memcpy(activeBlock + start.offset + 2, buf, len);
+			updateActiveBlock(start.offset, buf, len);
 			start.block++;
 			start.offset=0;
 		} else {
 			len = end.offset - start.offset;
-			memcpy(activeBlock + start.offset + 2, buf, len);
+			updateActiveBlock(start.offset, buf, len);
 			start.offset = end.offset;
 		}
-		activeBlockDirty = true;
 		buf = (uint8_t*)buf + len;
 	}
 
@@ -315,118 +513,1210 @@ int FlashWearLevelerBase::writeBytes(long addr, const void* buf, int len) {
 }
 
 
-void FlashWearLevelerBase::activateVirtualBlock(uint16_t virtualBlockHeader) {
-	uint16_t header = getActiveBlockHeader();
+//copies the data into the activeBlock. Rewriting the same data doesn't make the block dirty
+void FlashWearLevelerBase::updateActiveBlock(uint16_t offset, const void* buf, int len) {
+	uint8_t* p = activeBlock + offset + HEADER_SIZE;
+	if(memcmp(p, buf, len) != 0) {
+		memcpy(p, buf, len);
+		activeBlockDirty = true;
+	}
+}
+
+
+//returns false, if the dirty active block couldn't be written or the virtual block has no data and the free blocks
+//are reserved for the snapshot. The active block stays as it was then
+bool FlashWearLevelerBase::activateVirtualBlock(fwl_block_t virtualBlockHeader) {
+	fwl_block_t header = getActiveBlockHeader();
 	if(BLOCK_ID(virtualBlockHeader) != BLOCK_ID(header)) {
-		flush();
-		uint16_t physicalBlockHeader = blockMap[BLOCK_ID(virtualBlockHeader)];
-		FWL_ERR("Activate Physical Block %i", BLOCK_ID(physicalBlockHeader));
-		flashReadBytes(BLOCK_ID(physicalBlockHeader)*PHYSICAL_BLOCK_SIZE, activeBlock, 4096);
+		if(!flushActiveBlock()) return false;
+		fwl_block_t physicalBlockHeader = blockMap[BLOCK_ID(virtualBlockHeader)];
+		if(BLOCK_IS_FREE(physicalBlockHeader) && !snapshotAllows(BLOCK_ID(virtualBlockHeader), true)) {
+			FWL_ERR("The free blocks are reserved for the snapshot");
+			return false;
+		}
+		FWL_TRACE_EVENT(FT_ACTIVATE, BLOCK_ID(virtualBlockHeader), BLOCK_ID(physicalBlockHeader), 0);
+		long addr = BLOCK_ID(physicalBlockHeader)*PHYSICAL_BLOCK_SIZE;
+		int d = findDiscardedRange(BLOCK_ID(virtualBlockHeader));
+		if(physicalBlockHeader == ErasedHeader) {
+			//the virtual block gave its physical block to a transaction. It gets one, when it is flushed
+			memset(activeBlock, 0xFF, PHYSICAL_BLOCK_SIZE);
+			setActiveBlockHeader(BLOCK_ID(virtualBlockHeader) | BLOCK_NOT_DELETED_BIT);
+			dropDiscardedRange(BLOCK_ID(virtualBlockHeader));
+			return true;
+		} else if(BLOCK_IS_FREE(physicalBlockHeader)) {
+			//the virtual block holds no data (never written or discarded)
+			memset(activeBlock, 0xFF, PHYSICAL_BLOCK_SIZE);
+		} else if(blockHeaderCache[BLOCK_ID(physicalBlockHeader)] & BLOCK_COMPRESSED_BIT) {
+			if(compressBufferBlock == BLOCK_ID(physicalBlockHeader)) {
+				memcpy(activeBlock + HEADER_SIZE, compressBuffer, VIRTUAL_BLOCK_SIZE);
+			} else {
+				readCompressedBlock(addr, activeBlock + HEADER_SIZE);
+			}
+		} else if(d >= 0 && !verifyOnActivation) {
+			//the discarded range isn't read
+			flashReadBytes(addr, activeBlock, HEADER_SIZE + discardedStart[d]);
+			int rest = HEADER_SIZE + discardedEnd[d];
+			if(rest < PHYSICAL_BLOCK_SIZE) {
+				flashReadBytes(addr + rest, activeBlock + rest, PHYSICAL_BLOCK_SIZE - rest);
+			}
+		} else {
+			flashReadBytes(addr, activeBlock, PHYSICAL_BLOCK_SIZE);
+			if(verifyOnActivation && !trailerMatches(activeBlock, PHYSICAL_BLOCK_SIZE - FWL_TRAILER_SIZE)) {
+				FWL_ERR("Checksum error in block at %08lx", addr);
+				stats.checksumErrors++;
+			}
+		}
+		if(d >= 0 && !BLOCK_IS_FREE(physicalBlockHeader)) {
+			//the flash still has the old data. An aborted transaction brings it back
+			memset(activeBlock + HEADER_SIZE + discardedStart[d], 0xFF, discardedEnd[d] - discardedStart[d]);
+			activeBlockDirty = true;
+		}
+		dropDiscardedRange(BLOCK_ID(virtualBlockHeader));
 		//it might be that we load a erased flash page, were the header would be 0xffff. Lets correct that and mark the block as unfree
-		header = blockHeaderCache[BLOCK_ID(physicalBlockHeader)] | BLOCK_NOT_DELETED_BIT;
-		((uint16_t*)activeBlock)[0] = header;
-		blockHeaderCache[BLOCK_ID(physicalBlockHeader)] = header;
+		//the cache keeps the compressed bit, as the flash still holds the compressed copy
+		setBlockHeader(BLOCK_ID(physicalBlockHeader), blockHeaderCache[BLOCK_ID(physicalBlockHeader)] | BLOCK_NOT_DELETED_BIT);
+		header = blockHeaderCache[BLOCK_ID(physicalBlockHeader)] & ~BLOCK_COMPRESSED_BIT;
+		setActiveBlockHeader(header);
 		assert(BLOCK_ID(virtualBlockHeader) == BLOCK_ID(getActiveBlockHeader()));
 	}
+	return true;
 }
 
 
-uint16_t FlashWearLevelerBase::readBlockHeader(uint16_t physicalBlockId) {
-	uint16_t res;
-	flashReadBytes(physicalBlockId*PHYSICAL_BLOCK_SIZE, &res, sizeof(uint16_t));
+//reads and decompresses the block at addr into the VIRTUAL_BLOCK_SIZE bytes at out. The compressed data is read
+//in chunks, so out can be the activeBlock or the compressBuffer. A block, which can't be read, becomes 0xff
+bool FlashWearLevelerBase::readCompressedBlock(long addr, uint8_t* out) {
+	uint16_t len;
+	flashReadBytes(addr + HEADER_SIZE, &len, sizeof(len));
+	if(len > COMPRESSED_MAX_SIZE) {
+		FWL_ERR("Can't read compressed block at %08lx", addr);
+		memset(out, 0xFF, VIRTUAL_BLOCK_SIZE);
+		return false;
+	}
+#ifdef FWL_BLOCK_CRC
+	uint32_t crc = flashcrc32(0, &len, sizeof(len));
+#endif
+	//a chunk keeps the start of a sequence, which continues in the next one
+	uint8_t chunk[64];
+	int kept = 0;
+	int pos = 0;
+	int decompressed = 0;
+	while(pos < len && decompressed >= 0) {
+		int n = len - pos < (int)sizeof(chunk) - kept ? len - pos : (int)sizeof(chunk) - kept;
+		flashReadBytes(addr + COMPRESSED_HEADER_SIZE + pos, chunk + kept, n);
+#ifdef FWL_BLOCK_CRC
+		if(verifyOnActivation) crc = flashcrc32(crc, chunk + kept, n);
+#endif
+		pos += n;
+		kept += n;
+		int used;
+		decompressed = flashlz_decompress_part(chunk, kept, &used, out, decompressed, VIRTUAL_BLOCK_SIZE);
+		kept -= used;
+		memmove(chunk, chunk + used, kept);
+	}
+#ifdef FWL_BLOCK_CRC
+	uint32_t stored;
+	if(verifyOnActivation && (flashReadBytes(addr + COMPRESSED_HEADER_SIZE + len, &stored, sizeof(stored)), stored != crc)) {
+		FWL_ERR("Checksum error in block at %08lx", addr);
+		stats.checksumErrors++;
+	}
+#endif
+	if(decompressed != VIRTUAL_BLOCK_SIZE || kept != 0) {
+		FWL_ERR("Corrupt compressed block at %08lx", addr);
+		memset(out, 0xFF, VIRTUAL_BLOCK_SIZE);
+		return false;
+	}
+	return true;
+}
+
+
+//the data of a compressed physical block, which isn't active. It is decompressed into the compressBuffer and stays
+//there, until the buffer is needed for a flush or the block is erased. The active block stays as it is
+const uint8_t* FlashWearLevelerBase::decompressedBlock(fwl_block_t physicalBlockId) {
+	if(compressBuffer == 0) {
+		FWL_ERR("Can't read compressed block %li without a compression buffer", (long)physicalBlockId);
+		return 0;
+	}
+	if(compressBufferBlock != physicalBlockId) {
+		compressBufferBlock = readCompressedBlock((long)physicalBlockId*PHYSICAL_BLOCK_SIZE, compressBuffer) ?
+			physicalBlockId : ErasedHeader;
+	}
+	return compressBuffer;
+}
+
+
+//reads the physical block into the empty activeBlock and checks its trailer. Only for initialize()
+bool FlashWearLevelerBase::verifyBlock(fwl_block_t physicalBlockId) {
+	flashReadBytes((long)physicalBlockId*PHYSICAL_BLOCK_SIZE, activeBlock, PHYSICAL_BLOCK_SIZE);
+	int len = PHYSICAL_BLOCK_SIZE - FWL_TRAILER_SIZE;
+	if(blockHeaderCache[physicalBlockId] & BLOCK_COMPRESSED_BIT) {
+		uint16_t compressedLen;
+		memcpy(&compressedLen, activeBlock + HEADER_SIZE, sizeof(compressedLen));
+		len = compressedLen > COMPRESSED_MAX_SIZE ? 0 : COMPRESSED_HEADER_SIZE + compressedLen;
+	}
+	bool ok = len > 0 && trailerMatches(activeBlock, len);
+	memset(activeBlock, 0xFF, PHYSICAL_BLOCK_SIZE);
+	if(!ok) {
+		FWL_ERR("Checksum error in block %li", (long)physicalBlockId);
+		stats.checksumErrors++;
+	}
+	return ok;
+}
+
+
+//true, if the virtual block is stored compressed on flash
+bool FlashWearLevelerBase::isCompressed(fwl_block_t virtualBlockId) {
+	fwl_block_t physicalBlockHeader = blockMap[virtualBlockId];
+	return !BLOCK_IS_FREE(physicalBlockHeader) && (blockHeaderCache[BLOCK_ID(physicalBlockHeader)] & BLOCK_COMPRESSED_BIT);
+}
+
+
+fwl_block_t FlashWearLevelerBase::readBlockHeader(fwl_block_t physicalBlockId) {
+	fwl_block_t res;
+	flashReadBytes(physicalBlockId*PHYSICAL_BLOCK_SIZE, &res, sizeof(fwl_block_t));
 	return res;
 }
 
 
-uint16_t FlashWearLevelerBase::getActiveBlockHeader() {
-	return ((uint16_t*)activeBlock)[0];
+//the activeBlock is a byte array, a wide header may not be aligned
+fwl_block_t FlashWearLevelerBase::getActiveBlockHeader() {
+	fwl_block_t header;
+	memcpy(&header, activeBlock, sizeof(header));
+	return header;
+}
+
+
+void FlashWearLevelerBase::setActiveBlockHeader(fwl_block_t header) {
+	memcpy(activeBlock, &header, sizeof(header));
 }
 
 
 bool FlashWearLevelerBase::flushNeeded() {
-	FWL_DBG("Flush Needed %i", activeBlockDirty);
 	return activeBlockDirty;
 }
 
 
-void FlashWearLevelerBase::flush() {
-	if(!activeBlockDirty) return;
+bool FlashWearLevelerBase::flush() {
+	if(activeBlockDirty || txState == TX_PENDING) {
+		FWL_TRACE_EVENT(FT_FLUSH, BLOCK_ID(getActiveBlockHeader()), 0, 0);
+	}
+	return flushActiveBlock();
+}
+
+
+//the flushes of the leveler itself aren't traced as FT_FLUSH, a replay of the api calls does them again
+//returns false, if the active block couldn't be written. It stays dirty then
+bool FlashWearLevelerBase::flushActiveBlock() {
+	if(txState == TX_PENDING) {
+		//a flush outside of a transaction commits the deferred transactions
+		txState = TX_OPEN;
+		return commitTransaction(true);
+	}
+	if(!activeBlockDirty) return true;
+	if(activeBlockMatchesFlash()) {
+		//the data was changed and changed back
+		activeBlockDirty = false;
+		stats.skippedFlushes++;
+		FWL_TRACE_EVENT(FT_SKIP_FLUSH, BLOCK_ID(getActiveBlockHeader()), 0, 0);
+		return true;
+	}
+	bool hot = updateHeat(BLOCK_ID(getActiveBlockHeader()));
+	if(!writeActiveBlock(!hotColdSeparation ? PLACE_NEXT : hot ? PLACE_HOT : PLACE_COLD)) return false;
+	if(hot && txState == TX_NONE) {
+		relocateColdBlock();
+	}
+	return true;
+}
+
+
+bool FlashWearLevelerBase::idle() {
+	if(!flashSleepDue()) return false;
+	sleep();
+	return true;
+}
+
+
+void FlashWearLevelerBase::sleep() {
+	FWL_TRACE_EVENT(FT_SLEEP, 0, 0, 0);
+	if(activeBlockDirty || txState == TX_PENDING) {
+		//written now, the erase of the old block finishes before the flash sleeps
+		flushActiveBlock();
+		stats.flushesBeforeSleep++;
+	}
+	flashSleep();
+}
+
+
+//compares the activeBlock with its copy on flash
+//a compressed copy is compared by compressing the activeBlock, the codec is deterministic
+bool FlashWearLevelerBase::activeBlockMatchesFlash() {
+	fwl_block_t physicalBlockHeader = blockMap[BLOCK_ID(getActiveBlockHeader())];
+	if(BLOCK_IS_FREE(physicalBlockHeader)) return false;
+
+	long addr = BLOCK_ID(physicalBlockHeader)*PHYSICAL_BLOCK_SIZE;
+	const uint8_t* data = activeBlock + HEADER_SIZE;
+	int len = VIRTUAL_BLOCK_SIZE;
+	if(blockHeaderCache[BLOCK_ID(physicalBlockHeader)] & BLOCK_COMPRESSED_BIT) {
+		if(compressBuffer == 0) return false;
+		compressBufferBlock = ErasedHeader;
+		len = flashlz_compress(activeBlock + HEADER_SIZE, VIRTUAL_BLOCK_SIZE, compressBuffer, COMPRESSED_MAX_SIZE);
+		uint16_t storedLen;
+		flashReadBytes(addr + HEADER_SIZE, &storedLen, sizeof(storedLen));
+		if(len == 0 || len != storedLen) return false;
+		data = compressBuffer;
+		addr += COMPRESSED_HEADER_SIZE;
+	} else {
+		addr += HEADER_SIZE;
+	}
+
+	//compare in chunks, most changed blocks differ early
+	uint8_t chunk[64];
+	int pos;
+	for(pos=0; pos<len; pos+=sizeof(chunk)) {
+		int n = len - pos < (int)sizeof(chunk) ? len - pos : sizeof(chunk);
+		flashReadBytes(addr + pos, chunk, n);
+		if(memcmp(chunk, data + pos, n) != 0) return false;
+	}
+	return true;
+}
+
+
+void FlashWearLevelerBase::setHotColdSeparation(bool enable) {
+	hotColdSeparation = enable && blockHeat != 0 && blockLastFlush != 0 && eraseCount != 0;
+}
+
+
+void FlashWearLevelerBase::setCompression(bool enable) {
+	compression = enable && compressBuffer != 0;
+}
+
+
+void FlashWearLevelerBase::setVerification(bool onActivation, bool onMount) {
+	verifyOnActivation = onActivation && FWL_TRAILER_SIZE > 0;
+	verifyOnMount = onMount && FWL_TRAILER_SIZE > 0;
+}
+
+
+const FlashWearLevelerStats& FlashWearLevelerBase::getStats() {
+	return stats;
+}
+
+
+void FlashWearLevelerBase::resetStats() {
+	memset(&stats, 0, sizeof(stats));
+}
+
+
+//writes the active block to a free physical block and releases the old one. Returns false, if it wasn't written
+bool FlashWearLevelerBase::writeActiveBlock(uint8_t placement) {
 	//header contains the virtual block id
-	uint16_t header = getActiveBlockHeader();
+	fwl_block_t header = getActiveBlockHeader();
 
 	//physicalBlock contains a block header pointing to the current physical Block in use
-	uint16_t currentPhysicalBlock = blockMap[BLOCK_ID(header)];
-	FWL_DBG("Flush Physical Block %i", BLOCK_ID(currentPhysicalBlock));
-	uint16_t nextPhysicalBlock;
+	fwl_block_t currentPhysicalBlock = blockMap[BLOCK_ID(header)];
+	fwl_block_t nextPhysicalBlock;
+
+	//inside a transaction remember the block, which has to survive until the commit
+	int tx = -1;
+	if(txState != TX_NONE) {
+		tx = stageBlock(BLOCK_ID(header));
+		if(tx < 0) {
+			FWL_ERR("Too many blocks in transaction");
+			txFailed = true;
+			return false;
+		}
+		if(!openJournal()) {
+			txFailed = true;
+			return false;
+		}
+	}
+
+	//a block without data got checked by activateVirtualBlock()
+	if(!BLOCK_IS_FREE(currentPhysicalBlock) && !snapshotAllows(BLOCK_ID(header), tx >= 0 && txOld[tx] == currentPhysicalBlock)) {
+		FWL_ERR("The free blocks are reserved for the snapshot");
+		txFailed = txState != TX_NONE;
+		return false;
+	}
 
 	//if the block is free (first write to this virtual block) use it directly
-	if(BLOCK_IS_FREE(currentPhysicalBlock)) {
+	if(BLOCK_IS_FREE(currentPhysicalBlock) && currentPhysicalBlock != ErasedHeader) {
 		nextPhysicalBlock = currentPhysicalBlock;
 	} else {
-		//search a free physical block, starting from the current physical block
-		nextPhysicalBlock = ErasedHeader;
-		int i;
-		for(i=BLOCK_ID(currentPhysicalBlock); i<blockCount; i++) {
-			if(BLOCK_IS_FREE(blockHeaderCache[i])) {
-				nextPhysicalBlock = i;
-				break;
-			}
-		}
-
-		//no block found, wrap around
-		if(nextPhysicalBlock == ErasedHeader) {
-			for(i=0; i<BLOCK_ID(currentPhysicalBlock); i++) {
-				if(BLOCK_IS_FREE(blockHeaderCache[i])) {
-					nextPhysicalBlock = i;
-					break;
-				}
-			}
-		}
-
+		nextPhysicalBlock = findFreeBlock(currentPhysicalBlock, placement);
 		if(nextPhysicalBlock == ErasedHeader) {
 			FWL_ERR("Didn't find free block to write to");
-			return;
+			txFailed = txState != TX_NONE;
+			return false;
 		}
 	}
 
+	//the journal has to know the block, before it gets written
+	if(tx >= 0 && !writeJournalEntry(BLOCK_ID(header), BLOCK_ID(nextPhysicalBlock))) {
+		txFailed = true;
+		return false;
+	}
+
 	//usedVirtualBlock will point to a free virtual block
-	uint16_t usedVirtualBlock = blockHeaderCache[BLOCK_ID(nextPhysicalBlock)];
+	fwl_block_t usedVirtualBlock = blockHeaderCache[BLOCK_ID(nextPhysicalBlock)];
 
 	//write the new physical block
 	//construct the physical address to write
 	long addr;
 	addr = BLOCK_ID(nextPhysicalBlock)*PHYSICAL_BLOCK_SIZE;
 	//write the activeBlock to flash
-	FWL_DBG("write phys %i %i", addr, PHYSICAL_BLOCK_SIZE);
-	//flashBlockErase4K(addr);
-	flashWriteBytes(addr, activeBlock, PHYSICAL_BLOCK_SIZE);
-	blockHeaderCache[BLOCK_ID(nextPhysicalBlock)] = header | BLOCK_NOT_DELETED_BIT;
-	blockMap[BLOCK_ID(header)] = nextPhysicalBlock | BLOCK_NOT_DELETED_BIT;
+	eraseIfDirty(BLOCK_ID(nextPhysicalBlock));
+	setErased(BLOCK_ID(nextPhysicalBlock), false);
+	fwl_block_t flags = BLOCK_NOT_DELETED_BIT;
+	int compressedLen = 0;
+	int programmed;
+	if(compression) {
+		compressBufferBlock = ErasedHeader;
+		compressedLen = flashlz_compress(activeBlock + HEADER_SIZE, VIRTUAL_BLOCK_SIZE, compressBuffer + COMPRESSED_HEADER_SIZE, COMPRESSED_MAX_SIZE);
+	}
+	if(compressedLen > 0) {
+		//only the used pages get programmed, the rest of the block stays erased
+		flags |= BLOCK_COMPRESSED_BIT;
+		fwl_block_t blockHeader = header | flags;
+		uint16_t len = compressedLen;
+		memcpy(compressBuffer, &blockHeader, HEADER_SIZE);
+		memcpy(compressBuffer + HEADER_SIZE, &len, sizeof(len));
+		programmed = appendTrailer(compressBuffer, compressedLen + COMPRESSED_HEADER_SIZE);
+		flashWriteBytes(addr, compressBuffer, programmed);
+		stats.compressedFlushes++;
+		stats.uncompressedBytes += PHYSICAL_BLOCK_SIZE;
+		stats.compressedBytes += programmed;
+	} else {
+		programmed = appendTrailer(activeBlock, PHYSICAL_BLOCK_SIZE - FWL_TRAILER_SIZE);
+		flashWriteBytes(addr, activeBlock, programmed);
+	}
+	stats.bytesProgrammed += programmed;
+	stats.flushes++;
+	FWL_TRACE_EVENT(FT_WRITE_BLOCK, BLOCK_ID(header), BLOCK_ID(nextPhysicalBlock), programmed);
+	setBlockHeader(BLOCK_ID(nextPhysicalBlock), header | flags);
+	setBlockMap(BLOCK_ID(header), nextPhysicalBlock | BLOCK_NOT_DELETED_BIT);
 
 	//if the old physical block was different to the current
 	//mark the old physical block as deleted
 	if(BLOCK_ID(currentPhysicalBlock) != BLOCK_ID(nextPhysicalBlock)) {
-		currentPhysicalBlock = currentPhysicalBlock & ~BLOCK_NOT_DELETED_BIT;
-		addr = BLOCK_ID(currentPhysicalBlock)*PHYSICAL_BLOCK_SIZE;
-		//TODO ensure that this works...(writing zeros to an already written byte
-		flashWriteBytes(addr, &currentPhysicalBlock, sizeof(currentPhysicalBlock));
-		//the current block must point to the virtual block, where we took the next block from
-		blockHeaderCache[BLOCK_ID(currentPhysicalBlock)] = usedVirtualBlock;
-		blockMap[BLOCK_ID(usedVirtualBlock)] = currentPhysicalBlock;
-		//erase the current physicalBlock
-		//TODO either erase here, or before writing
-		flashBlockErase4K(addr);
+		if(currentPhysicalBlock == ErasedHeader || (tx >= 0 && txOld[tx] == currentPhysicalBlock)
+				|| holdForSnapshot(BLOCK_ID(header), currentPhysicalBlock)) {
+			//there is no old block, or it is needed until the commit or by the snapshot. So the virtual block, where we took the next block from, has none now
+			if(usedVirtualBlock != ErasedHeader) {
+				unmapVirtualBlock(BLOCK_ID(usedVirtualBlock));
+			}
+		} else {
+			releasePhysicalBlock(currentPhysicalBlock);
+			currentPhysicalBlock = currentPhysicalBlock & ~BLOCK_NOT_DELETED_BIT;
+			if(usedVirtualBlock == ErasedHeader) {
+				adoptFreeBlock(BLOCK_ID(currentPhysicalBlock));
+			} else {
+				//the current block must point to the virtual block, where we took the next block from
+				setBlockHeader(BLOCK_ID(currentPhysicalBlock), usedVirtualBlock);
+				setBlockMap(BLOCK_ID(usedVirtualBlock), currentPhysicalBlock);
+			}
+		}
 	}
 
 	activeBlockDirty = false;
 	printCaches();
+	return true;
 }
 
+//search a free physical block, starting from the current physical block
+//hot blocks go to the least worn of the next FREE_CANDIDATES free blocks, cold ones to the most worn
+//returns ErasedHeader, if there is no free block
+fwl_block_t FlashWearLevelerBase::findFreeBlock(fwl_block_t currentPhysicalBlock, uint8_t placement) {
+	fwl_block_t best = ErasedHeader;
+	fwl_block_t start = BLOCK_ID(currentPhysicalBlock) % blockCount;
+	fwl_block_t i = nextFreeBlock(start);
+	bool wrapped = false;
+	int candidates = 0;
+	while(candidates < FREE_CANDIDATES) {
+		if(i == ErasedHeader) {
+			//wrap around at the end
+			if(wrapped) break;
+			wrapped = true;
+			i = nextFreeBlock(0);
+			continue;
+		}
+		if(wrapped && i >= start) break;
+		if(placement == PLACE_NEXT) return i;
+		if(best == ErasedHeader || (placement == PLACE_HOT ? eraseCount[i] < eraseCount[best] : eraseCount[i] > eraseCount[best])) {
+			best = i;
+		}
+		candidates++;
+		i = nextFreeBlock(i + 1);
+	}
+	return best;
+}
+
+
+//the first free physical block at or after the given one, ErasedHeader if there is none
+fwl_block_t FlashWearLevelerBase::nextFreeBlock(fwl_block_t physicalBlockId) {
+	if(freeMap == 0) {
+		for( ; physicalBlockId<blockCount; physicalBlockId++) {
+			if(BLOCK_IS_FREE(blockHeaderCache[physicalBlockId])) return physicalBlockId;
+		}
+		return ErasedHeader;
+	}
+	return nextMapBit(freeMap, physicalBlockId);
+}
+
+
+//the first block at or after the given one, whose entry is value. The bitmap of these blocks finds it without
+//looking at the entries, without the bitmaps the entries are searched. ErasedHeader if there is none
+fwl_block_t FlashWearLevelerBase::nextBlockWith(const uint32_t* map, fwl_block_t block, const fwl_block_t* entries, fwl_block_t value) {
+	if(freeMap == 0) {
+		for( ; block<blockCount; block++) {
+			if(entries[block] == value) return block;
+		}
+		return ErasedHeader;
+	}
+	return nextMapBit(map, block);
+}
+
+
+//the first set bit at or after the given block in one of the two level bitmaps, ErasedHeader if there is none
+//the bitmap skips 32 blocks per word and the summary 1024 per word
+fwl_block_t FlashWearLevelerBase::nextMapBit(const uint32_t* map, fwl_block_t block) {
+	if(block >= blockCount) return ErasedHeader;
+	const uint32_t* summary = map + freeMapWords;
+	fwl_block_t word = block / 32;
+	uint32_t bits = map[word] & (0xffffffffUL << (block % 32));
+	while(bits == 0) {
+		//the next word with a set bit
+		word++;
+		uint32_t words = word < freeMapWords ? summary[word / 32] & (0xffffffffUL << (word % 32)) : 0;
+		while(words == 0) {
+			word = (word / 32 + 1) * 32;
+			if(word >= freeMapWords) return ErasedHeader;
+			words = summary[word / 32];
+		}
+		word = (word & ~(fwl_block_t)31) + __builtin_ctzl(words);
+		bits = map[word];
+	}
+	return word * 32 + __builtin_ctzl(bits);
+}
+
+
+void FlashWearLevelerBase::setMapBit(uint32_t* map, fwl_block_t block, bool set) {
+	uint32_t* word = map + block / 32;
+	uint32_t bit = 1UL << (block % 32);
+	if(set) {
+		*word |= bit;
+	} else {
+		*word &= ~bit;
+	}
+	uint32_t* summary = map + freeMapWords + block / 1024;
+	bit = 1UL << ((block / 32) % 32);
+	if(*word) {
+		*summary |= bit;
+	} else {
+		*summary &= ~bit;
+	}
+}
+
+
+//all changes of blockHeaderCache go through here, to keep the bitmaps of the free, unowned and held blocks up to date
+void FlashWearLevelerBase::setBlockHeader(fwl_block_t physicalBlockId, fwl_block_t header) {
+	if(BLOCK_IS_FREE(header) != BLOCK_IS_FREE(blockHeaderCache[physicalBlockId])) {
+		freeBlocks += BLOCK_IS_FREE(header) ? 1 : -1;
+	}
+	blockHeaderCache[physicalBlockId] = header;
+	if(freeMap == 0) return;
+	setMapBit(freeMap, physicalBlockId, BLOCK_IS_FREE(header));
+	setMapBit(unownedMap, physicalBlockId, header == ErasedHeader);
+	setMapBit(heldMap, physicalBlockId, header == HELD_HEADER);
+}
+
+
+//all changes of blockMap after the mount go through here, to keep the bitmap of the virtual blocks without a
+//physical block up to date
+void FlashWearLevelerBase::setBlockMap(fwl_block_t virtualBlockId, fwl_block_t physicalBlockHeader) {
+	blockMap[virtualBlockId] = physicalBlockHeader;
+	if(freeMap == 0) return;
+	setMapBit(unmappedMap, virtualBlockId, physicalBlockHeader == ErasedHeader);
+}
+
+
+//and counts the free blocks
+void FlashWearLevelerBase::rebuildFreeMap() {
+	fwl_block_t i;
+	freeBlocks = 0;
+	for(i=0; i<blockCount; i++) {
+		if(BLOCK_IS_FREE(blockHeaderCache[i])) freeBlocks++;
+	}
+	if(freeMap == 0) return;
+	//the erased bitmap behind them stays
+	memset(freeMap, 0, (erasedMap - freeMap) * sizeof(uint32_t));
+	for(i=0; i<blockCount; i++) {
+		setBlockHeader(i, blockHeaderCache[i]);
+		setBlockMap(i, blockMap[i]);
+	}
+}
+
+
+//counts the flush of the virtual block. returns true, if the block was hot before this flush
+//the heat is tracked without hot/cold separation too, maintenance() needs it
+bool FlashWearLevelerBase::updateHeat(fwl_block_t virtualBlockId) {
+	if(blockHeat == 0) return false;
+	flushSequence++;
+	if(flushSequence % blockCount == 0) {
+		//age all blocks
+		fwl_block_t i;
+		for(i=0; i<blockCount; i++) {
+			blockHeat[i] >>= 1;
+		}
+	}
+	bool hot = blockHeat[virtualBlockId] >= HOT_THRESHOLD;
+	blockHeat[virtualBlockId] = blockHeat[virtualBlockId] > 255 - HEAT_INCREMENT ? 255 : blockHeat[virtualBlockId] + HEAT_INCREMENT;
+	blockLastFlush[virtualBlockId] = flushSequence;
+	return hot;
+}
+
+
+//cost-benefit relocation of static data
+//a cold block on a barely worn physical block is moved to the most worn free block. That costs one erase
+//and pays off by the wear difference times the time the data stayed unchanged, as the freed block joins
+//the rotation of the hot blocks
+void FlashWearLevelerBase::relocateColdBlock() {
+	//the moved block would be held for the snapshot and take a free block
+	if(!hotColdSeparation || snapshot != 0) return;
+	if(++flushesSinceRelocation < RELOCATE_INTERVAL) return;
+	flushesSinceRelocation = 0;
+
+	fwl_block_t target = findFreeBlock(0, PLACE_COLD);
+	if(target == ErasedHeader) return;
+	fwl_block_t victim = findColdBlock(target, RELOCATE_FLUSH_SPREAD);
+	if(victim == ErasedHeader) return;
+	//the active block is clean after a flush, so it can carry the data
+	migrateBlock(victim);
+}
+
+
+//the cold virtual block in the next RELOCATE_WINDOW blocks, which benefits most from moving to the target
+//returns ErasedHeader, if none is worn at least minSpread erases less than the target
+fwl_block_t FlashWearLevelerBase::findColdBlock(fwl_block_t target, uint16_t minSpread) {
+	fwl_block_t victim = ErasedHeader;
+	uint32_t bestBenefit = 0;
+	fwl_block_t window = blockCount < RELOCATE_WINDOW ? blockCount : RELOCATE_WINDOW;
+	fwl_block_t n;
+	for(n=0; n<window; n++) {
+		fwl_block_t i = (relocateCursor + n) % blockCount;
+		fwl_block_t physicalBlockHeader = blockMap[i];
+		if(BLOCK_IS_FREE(physicalBlockHeader) || blockHeat[i] != 0) continue;
+		fwl_block_t p = BLOCK_ID(physicalBlockHeader);
+		if(eraseCount[target] < eraseCount[p] + minSpread) continue;
+		uint16_t age = flushSequence - blockLastFlush[i];
+		uint32_t benefit = (uint32_t)(eraseCount[target] - eraseCount[p]) * age;
+		if(benefit > bestBenefit) {
+			bestBenefit = benefit;
+			victim = i;
+		}
+	}
+	relocateCursor = (relocateCursor + window) % blockCount;
+	return victim;
+}
+
+
+//rewrites the virtual block to the most worn free block. The active block has to be clean
+void FlashWearLevelerBase::migrateBlock(fwl_block_t virtualBlockId) {
+	FWL_TRACE_EVENT(FT_RELOCATE, virtualBlockId, 0, 0);
+	activateVirtualBlock(virtualBlockId);
+	activeBlockDirty = true;
+	if(!writeActiveBlock(PLACE_COLD)) {
+		//the data is on flash already
+		activeBlockDirty = false;
+		return;
+	}
+	stats.relocations++;
+}
+
+
+static unsigned long maintenanceMicros() {
+#ifdef ARDUINO
+	return micros();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)(ts.tv_sec * 1000000UL + ts.tv_nsec / 1000);
+#endif
+}
+
+
+//static wear leveling: moves cold data off barely worn blocks, until the budget would be exceeded or
+//a pass over all blocks found nothing to move. A migration is only started, if the slowest recent one still fits
+int FlashWearLevelerBase::maintenance(unsigned long timeBudgetMicros) {
+	if(blockHeat == 0 || eraseCount == 0 || activeBlockDirty || txState != TX_NONE || snapshot != 0) return 0;
+	unsigned long start = maintenanceMicros();
+	fwl_block_t migrated = 0;
+	//blocks looked at since the last migration
+	fwl_block_t scanned = 0;
+	while(scanned < blockCount && migrated < blockCount) {
+		if(maintenanceMicros() - start + migrationMicros > timeBudgetMicros) break;
+		fwl_block_t target = findFreeBlock(0, PLACE_COLD);
+		if(target == ErasedHeader) break;
+		fwl_block_t victim = findColdBlock(target, RELOCATE_MIN_SPREAD);
+		if(victim == ErasedHeader) {
+			scanned += blockCount < RELOCATE_WINDOW ? blockCount : RELOCATE_WINDOW;
+			continue;
+		}
+		scanned = 0;
+
+		unsigned long migrationStart = maintenanceMicros();
+		migrateBlock(victim);
+		unsigned long duration = maintenanceMicros() - migrationStart;
+		//the estimate follows the slowest migration and decays slowly, as erase times vary
+		migrationMicros -= migrationMicros / 8;
+		if(duration > migrationMicros) migrationMicros = duration;
+		migrated++;
+	}
+	return migrated;
+}
+
+
+//marks the physical block as deleted on flash and erases it
+//the caller is responsible for updating blockMap and blockHeaderCache
+void FlashWearLevelerBase::releasePhysicalBlock(fwl_block_t physicalBlockHeader) {
+	fwl_block_t deletedHeader = physicalBlockHeader & ~BLOCK_NOT_DELETED_BIT;
+	long addr = BLOCK_ID(physicalBlockHeader)*PHYSICAL_BLOCK_SIZE;
+	FWL_TRACE_EVENT(FT_RELEASE, 0, BLOCK_ID(physicalBlockHeader), 0);
+	//TODO ensure that this works...(writing zeros to an already written byte
+	flashWriteBytes(addr, &deletedHeader, sizeof(deletedHeader));
+	//without the erased bitmap it is erased now, otherwise before it gets reused
+	if(erasedMap == 0) {
+		eraseBlock(BLOCK_ID(physicalBlockHeader));
+		return;
+	}
+	setErased(BLOCK_ID(physicalBlockHeader), false);
+	//the erase is due, the wear of the block has to count it for the choice of free blocks
+	if(eraseCount) {
+		eraseCount[BLOCK_ID(physicalBlockHeader)]++;
+	}
+}
+
+
+bool FlashWearLevelerBase::isErased(fwl_block_t physicalBlockId) {
+	//without the bitmap free blocks are always erased
+	if(erasedMap == 0) return BLOCK_IS_FREE(blockHeaderCache[physicalBlockId]);
+	return erasedMap[physicalBlockId / 32] & (1UL << (physicalBlockId % 32));
+}
+
+
+void FlashWearLevelerBase::setErased(fwl_block_t physicalBlockId, bool erased) {
+	if(erasedMap == 0) return;
+	if(erased) {
+		erasedMap[physicalBlockId / 32] |= 1UL << (physicalBlockId % 32);
+	} else {
+		erasedMap[physicalBlockId / 32] &= ~(1UL << (physicalBlockId % 32));
+	}
+}
+
+
+//eraseCount counts the erase of a released block already at the release
+void FlashWearLevelerBase::eraseBlock(fwl_block_t physicalBlockId) {
+	FWL_TRACE_EVENT(FT_ERASE, 0, physicalBlockId, 0);
+	flashBlockErase4K((long)physicalBlockId*PHYSICAL_BLOCK_SIZE);
+	if(physicalBlockId == compressBufferBlock) {
+		compressBufferBlock = ErasedHeader;
+	}
+	if(eraseCount && erasedMap == 0) {
+		eraseCount[physicalBlockId]++;
+	}
+	stats.erases++;
+	setErased(physicalBlockId, true);
+}
+
+
+//reads the block until the first programmed byte
+bool FlashWearLevelerBase::isBlank(fwl_block_t physicalBlockId) {
+	long addr = (long)physicalBlockId*PHYSICAL_BLOCK_SIZE;
+	uint8_t chunk[64];
+	int pos, i;
+	for(pos=0; pos<PHYSICAL_BLOCK_SIZE; pos+=sizeof(chunk)) {
+		flashReadBytes(addr + pos, chunk, sizeof(chunk));
+		for(i=0; i<(int)sizeof(chunk); i++) {
+			if(chunk[i] != 0xff) return false;
+		}
+	}
+	return true;
+}
+
+
+//blocks get erased right before they are programmed
+void FlashWearLevelerBase::eraseIfDirty(fwl_block_t physicalBlockId) {
+	if(erasedMap != 0 && !isErased(physicalBlockId)) {
+		eraseBlock(physicalBlockId);
+	}
+}
+
+
+//hands a released physical block to a virtual block without one, or leaves it unowned
+void FlashWearLevelerBase::adoptFreeBlock(fwl_block_t physicalBlockId) {
+	fwl_block_t virtualBlockId = nextBlockWith(unmappedMap, 0, blockMap, ErasedHeader);
+	if(virtualBlockId != ErasedHeader) {
+		setBlockMap(virtualBlockId, physicalBlockId);
+		setBlockHeader(physicalBlockId, virtualBlockId);
+		return;
+	}
+	setBlockHeader(physicalBlockId, ErasedHeader);
+}
+
+
+//takes the free physical block away from a virtual block. It gets an unowned one, if there is one
+void FlashWearLevelerBase::unmapVirtualBlock(fwl_block_t virtualBlockId) {
+	fwl_block_t physicalBlockId = nextBlockWith(unownedMap, 0, blockHeaderCache, ErasedHeader);
+	if(physicalBlockId != ErasedHeader) {
+		setBlockHeader(physicalBlockId, virtualBlockId);
+		setBlockMap(virtualBlockId, physicalBlockId);
+		return;
+	}
+	setBlockMap(virtualBlockId, ErasedHeader);
+}
+
+
+bool FlashWearLevelerBase::beginTransaction() {
+	FWL_TRACE_EVENT(FT_TX_BEGIN, 0, 0, 0);
+	if(txState == TX_OPEN) {
+		FWL_ERR("Transaction already open");
+		return false;
+	}
+	if(txState == TX_NONE) {
+		//changes from before aren't part of the transaction
+		if(!flushActiveBlock()) {
+			FWL_ERR("Can't flush before the transaction");
+			return false;
+		}
+		endTransaction();
+	}
+	//a deferred transaction continues the journal
+	txState = TX_OPEN;
+	return true;
+}
+
+
+bool FlashWearLevelerBase::commitTransaction(bool durable) {
+	FWL_TRACE_EVENT(FT_TX_COMMIT, 0, 0, durable);
+	if(txState != TX_OPEN) {
+		FWL_ERR("No open transaction");
+		return false;
+	}
+	if(!durable) {
+		//the active block stays cached, the next transaction may change it again for free
+		txState = TX_PENDING;
+		return !txFailed;
+	}
+
+	//write the active block as part of the transaction
+	flushActiveBlock();
+	if(txFailed) {
+		abortTransaction();
+		return false;
+	}
+
+	if(journalBlock != ErasedHeader) {
+		//from here on the new blocks are valid, even after a power loss
+		writeJournalEntry(JOURNAL_COMMIT, 0);
+		int i;
+		for(i=0; i<txCount; i++) {
+			if(!BLOCK_IS_FREE(txOld[i]) && !holdForSnapshot(txVirtual[i], txOld[i])) {
+				releasePhysicalBlock(txOld[i]);
+				adoptFreeBlock(BLOCK_ID(txOld[i]));
+			}
+		}
+		releasePhysicalBlock(journalBlock);
+		adoptFreeBlock(journalBlock);
+	}
+	endTransaction();
+	return true;
+}
+
+
+void FlashWearLevelerBase::abortTransaction() {
+	FWL_TRACE_EVENT(FT_TX_ABORT, 0, 0, 0);
+	if(txState == TX_NONE) return;
+
+	deactivateBlock();
+
+	//release the new blocks, before the journal is gone
+	int i;
+	for(i=txCount-1; i>=0; i--) {
+		fwl_block_t virtualBlockId = txVirtual[i];
+		fwl_block_t newPhysicalBlock = blockMap[virtualBlockId];
+		if(newPhysicalBlock == txOld[i]) continue;
+		setBlockMap(virtualBlockId, BLOCK_IS_FREE(txOld[i]) ? ErasedHeader : txOld[i]);
+		releasePhysicalBlock(newPhysicalBlock);
+		adoptFreeBlock(BLOCK_ID(newPhysicalBlock));
+	}
+	if(journalBlock != ErasedHeader) {
+		releasePhysicalBlock(journalBlock);
+		adoptFreeBlock(journalBlock);
+	}
+	endTransaction();
+}
+
+
+//drops the cached data without writing it
+void FlashWearLevelerBase::deactivateBlock() {
+	//activateVirtualBlock() might have marked a free physical block as used, revert that
+	fwl_block_t h = getActiveBlockHeader();
+	if(!BLOCK_IS_FREE(h)) {
+		fwl_block_t physicalBlockHeader = blockMap[BLOCK_ID(h)];
+		if(BLOCK_IS_FREE(physicalBlockHeader) && physicalBlockHeader != ErasedHeader) {
+			setBlockHeader(BLOCK_ID(physicalBlockHeader), BLOCK_ID(h));
+		}
+	}
+	activeBlockDirty = false;
+	memset(activeBlock, 0xFF, PHYSICAL_BLOCK_SIZE);
+}
+
+
+void FlashWearLevelerBase::endTransaction() {
+	txState = TX_NONE;
+	txFailed = false;
+	journalBlock = ErasedHeader;
+	journalEntries = 0;
+	txCount = 0;
+}
+
+
+//returns the index of the virtual block in the transaction, -1 if there is no space left
+int FlashWearLevelerBase::stageBlock(fwl_block_t virtualBlockId) {
+	int i;
+	for(i=0; i<txCount; i++) {
+		if(txVirtual[i] == virtualBlockId) return i;
+	}
+	if(txCount == FWL_MAX_TX_BLOCKS) return -1;
+	txVirtual[txCount] = virtualBlockId;
+	txOld[txCount] = blockMap[virtualBlockId];
+	return txCount++;
+}
+
+
+//allocates the journal block for the first block written in a transaction
+bool FlashWearLevelerBase::openJournal() {
+	if(journalBlock != ErasedHeader) return true;
+	fwl_block_t block = findFreeBlock(0, hotColdSeparation ? PLACE_COLD : PLACE_NEXT);
+	if(block == ErasedHeader || freeBlocks <= snapshotReserve + (snapshot ? 1 : 0)) {
+		FWL_ERR("Didn't find free block for the journal");
+		return false;
+	}
+	fwl_block_t usedVirtualBlock = blockHeaderCache[block];
+	fwl_block_t header = JOURNAL_HEADER;
+	eraseIfDirty(block);
+	setErased(block, false);
+	flashWriteBytes((long)block*PHYSICAL_BLOCK_SIZE, &header, sizeof(header));
+	setBlockHeader(block, header);
+	if(usedVirtualBlock != ErasedHeader) {
+		unmapVirtualBlock(BLOCK_ID(usedVirtualBlock));
+	}
+	journalBlock = block;
+	journalEntries = 0;
+	return true;
+}
+
+
+//appends an entry to the journal
+bool FlashWearLevelerBase::writeJournalEntry(fwl_block_t virtualBlockId, fwl_block_t physicalBlockId) {
+	//keep the last entry for the commit record
+	if(journalEntries == JOURNAL_MAX_ENTRIES - (virtualBlockId == JOURNAL_COMMIT ? 0 : 1)) {
+		FWL_ERR("Journal full");
+		return false;
+	}
+	fwl_block_t entry[2] = {virtualBlockId, physicalBlockId};
+	flashWriteBytes((long)journalBlock*PHYSICAL_BLOCK_SIZE + HEADER_SIZE + journalEntries*sizeof(entry), entry, sizeof(entry));
+	journalEntries++;
+	return true;
+}
+
+
+bool FlashWearLevelerBase::takeSnapshot(fwl_block_t* snapshotMap) {
+	if(snapshot != 0 || txState != TX_NONE) {
+		FWL_ERR("Can't take a snapshot");
+		return false;
+	}
+	//the snapshot references the flash copies
+	if(!flushActiveBlock()) return false;
+	//every block with data may be rewritten, and then needs a free block, while the snapshot keeps the old one
+	fwl_block_t reserve = 0;
+	fwl_block_t i;
+	for(i=0; i<blockCount; i++) {
+		if(!BLOCK_IS_FREE(blockMap[i])) reserve++;
+	}
+	if(freeBlocks <= reserve) {
+		FWL_ERR("%li free blocks, a snapshot needs %li", (long)freeBlocks, (long)reserve + 1);
+		return false;
+	}
+	memcpy(snapshotMap, blockMap, blockCount * sizeof(fwl_block_t));
+	snapshot = snapshotMap;
+	snapshotReserve = reserve;
+	FWL_TRACE_EVENT(FT_SNAPSHOT, 0, 0, 1);
+	return true;
+}
+
+
+void FlashWearLevelerBase::releaseSnapshot() {
+	if(snapshot == 0) return;
+	FWL_TRACE_EVENT(FT_SNAPSHOT, 0, 0, 0);
+	snapshot = 0;
+	snapshotReserve = 0;
+	fwl_block_t i = 0;
+	while((i = nextBlockWith(heldMap, i, blockHeaderCache, HELD_HEADER)) != ErasedHeader) {
+		releasePhysicalBlock(i | BLOCK_NOT_DELETED_BIT);
+		adoptFreeBlock(i);
+		i++;
+	}
+}
+
+
+//if the snapshot references the physical block of the virtual block, the block is kept instead of released
+//on flash it gets marked as deleted, so a remount ignores it
+bool FlashWearLevelerBase::holdForSnapshot(fwl_block_t virtualBlockId, fwl_block_t physicalBlockHeader) {
+	if(snapshot == 0 || snapshot[virtualBlockId] != physicalBlockHeader) return false;
+	fwl_block_t p = BLOCK_ID(physicalBlockHeader);
+	//keeps the compressed bit
+	fwl_block_t deletedHeader = blockHeaderCache[p] & ~BLOCK_NOT_DELETED_BIT;
+	flashWriteBytes((long)p*PHYSICAL_BLOCK_SIZE, &deletedHeader, sizeof(deletedHeader));
+	setBlockHeader(p, HELD_HEADER);
+	//the rewrite, that the block was reserved for, took its free block
+	snapshotReserve--;
+	FWL_TRACE_EVENT(FT_HOLD, virtualBlockId, p, 0);
+	return true;
+}
+
+
+//with a snapshot a free block is reserved for the rewrite of every block it references, plus one spare for the
+//rewrites of other blocks, which release their old block right away. Returns false, if the write of the virtual
+//block would take a reserved block: the first write of a block or, with keepsOld, a rewrite in a transaction
+bool FlashWearLevelerBase::snapshotAllows(fwl_block_t virtualBlockId, bool keepsOld) {
+	if(snapshot == 0) return true;
+	fwl_block_t physicalBlockHeader = blockMap[virtualBlockId];
+	if(!BLOCK_IS_FREE(physicalBlockHeader) && (snapshot[virtualBlockId] == physicalBlockHeader || !keepsOld)) {
+		return true;
+	}
+	return freeBlocks > snapshotReserve + 1;
+}
+
+
+int FlashWearLevelerBase::readSnapshot(long addr, void* buf, long len) {
+	if(snapshot == 0) {
+		FWL_ERR("No snapshot");
+		return -1;
+	}
+	addr_info start = SplitVirtualAddress(addr);
+	addr_info end = SplitVirtualAddress(addr + len);
+	if(end.block >= blockCount) {
+		FWL_ERR("Illegal block address %i", end.block);
+		return -1;
+	}
+
+	while(start != end) {
+		int n = end.block > start.block ? VIRTUAL_BLOCK_SIZE - start.offset : end.offset - start.offset;
+		fwl_block_t physicalBlockHeader = snapshot[start.block];
+		long physicalAddr = (long)BLOCK_ID(physicalBlockHeader)*PHYSICAL_BLOCK_SIZE;
+		fwl_block_t header;
+		if(BLOCK_IS_FREE(physicalBlockHeader)) {
+			memset(buf, 0xFF, n);
+		} else if(flashReadBytes(physicalAddr, &header, sizeof(header)), header & BLOCK_COMPRESSED_BIT) {
+			const uint8_t* data = decompressedBlock(BLOCK_ID(physicalBlockHeader));
+			if(data == 0) return -1;
+			memcpy(buf, data + start.offset, n);
+		} else {
+			flashReadBytes(physicalAddr + start.offset + HEADER_SIZE, buf, n);
+		}
+		buf = (uint8_t*)buf + n;
+		if(end.block > start.block) {
+			start.block++;
+			start.offset = 0;
+		} else {
+			start.offset = end.offset;
+		}
+	}
+	return 0;
+}
+
+
+//a committed journal makes its blocks the valid ones and releases the old ones, otherwise the new blocks get released
+//called by initialize() with the headers in blockHeaderCache, blockMap is used as scratch. Released blocks become ErasedHeader
+void FlashWearLevelerBase::recoverJournal(fwl_block_t journalBlockId) {
+	long addr = (long)journalBlockId*PHYSICAL_BLOCK_SIZE + HEADER_SIZE;
+	fwl_block_t entry[2];
+	int entries;
+	bool committed = false;
+	for(entries=0; entries<JOURNAL_MAX_ENTRIES; entries++) {
+		flashReadBytes(addr + entries*sizeof(entry), entry, sizeof(entry));
+		if(entry[0] == JOURNAL_COMMIT) {
+			committed = true;
+			break;
+		}
+		if(entry[0] >= blockCount || entry[1] >= blockCount) break;
+	}
+	FWL_TRACE_EVENT(FT_RECOVER_JOURNAL, committed, journalBlockId, entries);
+
+	memset(blockMap, 0xFF, blockCount * sizeof(fwl_block_t));
+	int i;
+	for(i=0; i<entries; i++) {
+		flashReadBytes(addr + i*sizeof(entry), entry, sizeof(entry));
+		fwl_block_t header = blockHeaderCache[entry[1]];
+		if(committed) {
+			//the last entry of a virtual block wins
+			blockMap[entry[0]] = entry[1];
+		} else if(!BLOCK_IS_FREE(header) && BLOCK_ID(header) == entry[0]) {
+			releasePhysicalBlock(entry[1] | BLOCK_NOT_DELETED_BIT);
+			blockHeaderCache[entry[1]] = ErasedHeader;
+		}
+	}
+	if(committed) {
+		//release all other copies of the virtual blocks in the journal
+		fwl_block_t p;
+		for(p=0; p<blockCount; p++) {
+			fwl_block_t header = blockHeaderCache[p];
+			if(BLOCK_IS_FREE(header) || BLOCK_ID(header) >= blockCount || p == journalBlockId) continue;
+			fwl_block_t newPhysicalBlock = blockMap[BLOCK_ID(header)];
+			if(newPhysicalBlock != ErasedHeader && newPhysicalBlock != p) {
+				releasePhysicalBlock(p | BLOCK_NOT_DELETED_BIT);
+				setBlockHeader(p, ErasedHeader);
+			}
+		}
+	}
+	releasePhysicalBlock(journalBlockId | BLOCK_NOT_DELETED_BIT);
+	setBlockHeader(journalBlockId, ErasedHeader);
+}
+
+
+int FlashWearLevelerBase::discard(long addr, long len) {
+	FWL_TRACE_EVENT(FT_DISCARD, 0, addr, len);
+	addr_info start = SplitVirtualAddress(addr);
+	addr_info end = SplitVirtualAddress(addr + len);
+	if(end.block > blockCount || (end.block == blockCount && end.offset != 0)) {
+		FWL_ERR("Illegal block address %i", end.block);
+		return -1;
+	}
+	if(txState == TX_OPEN) {
+		//discarded blocks are released at once, that can't be rolled back
+		FWL_ERR("Discard inside a transaction");
+		return -1;
+	}
+	if(txState == TX_PENDING && !flushActiveBlock()) {
+		return -1;
+	}
+
+	while(start != end) {
+		fwl_block_t h = getActiveBlockHeader();
+		bool isActive = !BLOCK_IS_FREE(h) && BLOCK_ID(h) == start.block;
+		if(end.block > start.block) {
+			if(start.offset == 0) {
+				//the whole block is gone
+				discardVirtualBlock(start.block);
+			} else if(isActive) {
+				memset(activeBlock + start.offset + HEADER_SIZE, 0xFF, VIRTUAL_BLOCK_SIZE - start.offset);
+				//the flash still has the old data
+				activeBlockDirty = true;
+			} else {
+				discardRange(start.block, start.offset, VIRTUAL_BLOCK_SIZE);
+			}
+			start.block++;
+			start.offset = 0;
+		} else {
+			if(isActive) {
+				memset(activeBlock + start.offset + HEADER_SIZE, 0xFF, end.offset - start.offset);
+				activeBlockDirty = true;
+			} else {
+				discardRange(start.block, start.offset, end.offset);
+			}
+			start.offset = end.offset;
+		}
+	}
+	return 0;
+}
+
+
+//frees the physical block of a virtual block, so that it doesn't get copied anymore
+//the virtual block afterwards reads as erased (0xff)
+void FlashWearLevelerBase::discardVirtualBlock(fwl_block_t virtualBlockId) {
+	fwl_block_t physicalBlockHeader = blockMap[virtualBlockId];
+	dropDiscardedRange(virtualBlockId);
+
+	fwl_block_t h = getActiveBlockHeader();
+	if(!BLOCK_IS_FREE(h) && BLOCK_ID(h) == virtualBlockId) {
+		deactivateBlock();
+	}
+
+	if(BLOCK_IS_FREE(physicalBlockHeader)) {
+		//nothing on flash
+		return;
+	}
+
+	if(holdForSnapshot(virtualBlockId, physicalBlockHeader)) {
+		unmapVirtualBlock(virtualBlockId);
+		return;
+	}
+
+	releasePhysicalBlock(physicalBlockHeader);
+	//the virtual block keeps its physical block, but as a free one (deleted bit = 0)
+	setBlockMap(virtualBlockId, BLOCK_ID(physicalBlockHeader));
+	setBlockHeader(BLOCK_ID(physicalBlockHeader), virtualBlockId);
+	printCaches();
+}
+
+//remembers the partial discard of an inactive block, until the block gets activated. A block has one range: an
+//overlapping or adjacent one is merged, otherwise the longer one is kept. With the table full it is dropped
+void FlashWearLevelerBase::discardRange(fwl_block_t virtualBlockId, uint16_t start, uint16_t end) {
+	//nothing on flash
+	if(BLOCK_IS_FREE(blockMap[virtualBlockId])) return;
+	int d = findDiscardedRange(virtualBlockId);
+	if(d >= 0) {
+		if(start <= discardedEnd[d] && end >= discardedStart[d]) {
+			if(discardedStart[d] < start) start = discardedStart[d];
+			if(discardedEnd[d] > end) end = discardedEnd[d];
+		} else if(end - start < discardedEnd[d] - discardedStart[d]) {
+			return;
+		}
+	} else {
+		if(discardedCount == FWL_DISCARDED_RANGES) return;
+		d = discardedCount++;
+		discardedBlock[d] = virtualBlockId;
+	}
+	discardedStart[d] = start;
+	discardedEnd[d] = end;
+}
+
+
+//index of the discarded range of the virtual block, -1 if it has none
+int FlashWearLevelerBase::findDiscardedRange(fwl_block_t virtualBlockId) {
+	int i;
+	for(i=0; i<discardedCount; i++) {
+		if(discardedBlock[i] == virtualBlockId) return i;
+	}
+	return -1;
+}
+
+
+void FlashWearLevelerBase::dropDiscardedRange(fwl_block_t virtualBlockId) {
+	int d = findDiscardedRange(virtualBlockId);
+	if(d < 0) return;
+	discardedCount--;
+	discardedBlock[d] = discardedBlock[discardedCount];
+	discardedStart[d] = discardedStart[discardedCount];
+	discardedEnd[d] = discardedEnd[discardedCount];
+}
+
+
 //returns the length of the virtual address space
 
 long FlashWearLevelerBase::getSize() {
 	//-1 to have at least one spare
-	return blockCount-1 * VIRTUAL_BLOCK_SIZE;
+	return (long)(blockCount-1) * VIRTUAL_BLOCK_SIZE;
+}
+
+
+long FlashWearLevelerBase::getBlockSize() {
+	return VIRTUAL_BLOCK_SIZE;
+}
+
+
+fwl_block_t FlashWearLevelerBase::getBlockCount() {
+	return blockCount;
 }
 
 
@@ -8,31 +8,204 @@
 
 typedef struct addr_info_ addr_info;
 
+//number of virtual blocks, which can be written in one transaction (or group of deferred transactions)
+#ifndef FWL_MAX_TX_BLOCKS
+#define FWL_MAX_TX_BLOCKS 8
+#endif
+
+//number of inactive virtual blocks, whose partial discard is kept until the block gets activated
+#ifndef FWL_DISCARDED_RANGES
+#define FWL_DISCARDED_RANGES 4
+#endif
+
+//32 bit block headers and map entries for more than 16383 blocks (chips above 64MB). The flash format differs,
+//a flash has to be formatted with the same setting. Define it here or with -DFWL_WIDE_HEADERS for all files
+//#define FWL_WIDE_HEADERS
+#ifdef FWL_WIDE_HEADERS
+typedef uint32_t fwl_block_t;
+#else
+typedef uint16_t fwl_block_t;
+#endif
+
+//a CRC32 of the block data in a trailer behind it, so that torn and corrupted blocks can be detected (see
+//setVerification()). The virtual blocks get 4 bytes smaller and the flash format differs, a flash has to be
+//formatted with the same setting. Define it here or with -DFWL_BLOCK_CRC for all files
+//#define FWL_BLOCK_CRC
+#ifdef FWL_BLOCK_CRC
+#define FWL_TRAILER_SIZE 4
+#else
+#define FWL_TRAILER_SIZE 0
+#endif
+
+//size of a two level bitmap in uint32_t: one bit per block plus one summary bit per bitmap word
+#define FWL_BITMAP_WORDS(blocks) (((blocks) + 31) / 32 + ((blocks) + 1023) / 1024)
+//size of the block bitmaps in uint32_t: the free, the unowned and the held physical blocks, the virtual blocks
+//without a physical block, and one erased bit per block
+#define FWL_FREE_MAP_WORDS(blocks) (FWL_BITMAP_WORDS(blocks) * 4 + ((blocks) + 31) / 32)
+
+//counters since startup or the last resetStats()
+struct FlashWearLevelerStats {
+	//blocks written to flash, including relocations
+	uint32_t flushes;
+	//bytes programmed by flushes, without the deleted markers
+	uint32_t bytesProgrammed;
+	//flushes, which wrote a compressed block
+	uint32_t compressedFlushes;
+	//size of the compressed blocks before and after compression
+	uint32_t uncompressedBytes;
+	uint32_t compressedBytes;
+	//cold blocks moved by the hot/cold separation and maintenance()
+	uint32_t relocations;
+	//flushes skipped, as the data matched the copy on flash
+	uint32_t skippedFlushes;
+	//sleep() calls, which flushed pending data or group commits first. Written later, each of them would wake
+	//the flash up, unless more writes to the same block came before
+	uint32_t flushesBeforeSleep;
+	//4k blocks erased, a chip erase counts every block
+	uint32_t erases;
+	//bytes read from the flash
+	uint32_t bytesRead;
+	//blocks, whose trailer didn't match their data
+	uint32_t checksumErrors;
+};
+
 class FlashWearLevelerBase {
 public:
 	//the pointers are passed in, to be able to statically allocate them inside the templated FlashWearLeveler
-	FlashWearLevelerBase(uint16_t noOf4kBlocks, uint16_t* blockMapMem, uint16_t* blockHeaderCacheMem);
+	//without blockHeatMem, blockLastFlushMem and eraseCountMem there is no hot/cold separation
+	//without the 4096 byte compressBufferMem, blocks can neither be written nor read compressed
+	//without freeMapMem (FWL_FREE_MAP_WORDS(noOf4kBlocks) words) the searches for free, unowned and held blocks
+	//are linear and released blocks are erased at once, instead of before they get reused
+	//flashOffset is the start of the leveler on the flash in bytes, the first block of its partition
+	FlashWearLevelerBase(fwl_block_t noOf4kBlocks, fwl_block_t* blockMapMem, fwl_block_t* blockHeaderCacheMem,
+			uint8_t* blockHeatMem=0, uint16_t* blockLastFlushMem=0, uint16_t* eraseCountMem=0,
+			uint8_t* compressBufferMem=0, uint32_t* freeMapMem=0, long flashOffset=0);
 	virtual ~FlashWearLevelerBase();
 	bool initialize();
 	bool format();
 	uint8_t readByte(long addr);
 	int readBytes(long addr, void* buf, long len);
+	//return -1, if the data can't be taken: the dirty active block couldn't be written to make room, or the
+	//free blocks are reserved for the snapshot. The blocks before the failing one are written
 	int writeByte(long addr, uint8_t byt);
 	int writeBytes(long addr, const void* buf, int len);
+	//tells the leveler, that the given virtual range doesn't contain valid data anymore, it reads as 0xff then.
+	//Whole virtual blocks are freed. The partial discard of an inactive block is kept in RAM for up to
+	//FWL_DISCARDED_RANGES blocks, so that its activation doesn't read the range. With the table full or after a
+	//reset the data of the range stays. Not allowed inside a transaction
+	int discard(long addr, long len);
+
+	//all writes between beginTransaction() and commitTransaction() reach the flash atomically, even across
+	//a power loss. Every written virtual block needs a free block until the commit, plus one for the journal
+	bool beginTransaction();
+	//with durable=false the commit record is deferred and shared with the following transactions (group commit).
+	//The group is committed by the next durable commit, flush() or a write outside of a transaction
+	bool commitTransaction(bool durable=true);
+	//discards the open transaction together with all deferred ones
+	void abortTransaction();
+
+	//freezes the current state by copying the block map into snapshotMap (getBlockCount() entries)
+	//until releaseSnapshot() the physical blocks it references aren't erased, so rewritten blocks need a free
+	//block each. These are reserved: it fails, unless there are more free blocks than blocks with data, and
+	//writes to blocks without data fail, once they would take a reserved block.
+	//There is one snapshot at a time, it is dropped by initialize() and not allowed in a transaction
+	bool takeSnapshot(fwl_block_t* snapshotMap);
+	void releaseSnapshot();
+	//reads the data as it was, when the snapshot was taken. Compressed blocks are decompressed in the compression
+	//buffer, the active block stays
+	int readSnapshot(long addr, void* buf, long len);
 
 	bool flushNeeded();
-	void flush();
+	//returns false, if the active block couldn't be written. It stays dirty, nothing is lost
+	bool flush();
+	//call this regularly while the application has nothing to do. Once the flash is due for deep power-down,
+	//the pending writes are flushed first, so they don't wake it up again. Returns true, if the flash went to sleep
+	bool idle();
+	//flushes and puts the flash into deep power-down, the next access wakes it up
+	void sleep();
+	//static wear leveling for idle time: moves data, which isn't rewritten, off barely worn blocks, so they
+	//take their share of the erases. Only starts a migration, if it is expected to finish within the budget.
+	//Needs the erase counts and block heats, does nothing while the active block is dirty, in a transaction or
+	//with a snapshot. Returns the number of migrated blocks.
+	//The erase counts are only kept in RAM and start at zero on every mount, so only the wear since the boot is
+	//seen. On devices, which reset often, it levels little. The duration of a migration is estimated from the
+	//previous ones, starting at 60ms. A 4K erase takes up to 400ms in the worst case, a migration, which hits one,
+	//overruns the budget by that much
+	int maintenance(unsigned long timeBudgetMicros);
+	//steer hot blocks to the least worn free blocks and move cold data off barely worn blocks (default on, if the
+	//erase counts and block heats exist). After flushes cold data is only moved, once the wear differs by 32
+	//erases, and not while a snapshot is held. So the total erases stay those without it, only the most worn block
+	//gets fewer (test/bench: 0.999 erases per write either way, the most worn block 320 instead of 373 erases)
+	void setHotColdSeparation(bool enable);
+	//compress blocks before writing them, if that saves at least one page (default on, if there is a buffer)
+	//reading from a compressed block, which isn't active, decompresses it into the compression buffer. The active
+	//block stays, so reads never write to the flash
+	void setCompression(bool enable);
+	//checks the CRC trailers of blocks, needs FWL_BLOCK_CRC (default off). On activation the whole block is checked,
+	//the reads of blocks, which aren't active, aren't. On mount only the blocks with two copies are checked: the ones,
+	//which got written again, but the power went off before the old copy was released. A torn copy is dropped.
+	//If both copies match, the one with the higher physical index is kept, there's no write order on the flash.
+	//After the allocation wrapped around that's the older copy. Mismatches are counted in the stats
+	void setVerification(bool onActivation, bool onMount);
+
+	const FlashWearLevelerStats& getStats();
+	void resetStats();
 
 	long virtual2physicalAddr(long addr);
 	long physical2virtualAddr(long addr);
 	long getSize();
+	//size of a virtual block. Writes within one virtual block end up in one physical block
+	long getBlockSize();
+	//number of 4k blocks
+	fwl_block_t getBlockCount();
 
 	void printCaches();
 protected:
-	uint16_t readBlockHeader(uint16_t physicalBlockId);
-	uint16_t getActiveBlockHeader();
-	void activateVirtualBlock(uint16_t virtualBlockHeader);
+	bool flushActiveBlock();
+	fwl_block_t readBlockHeader(fwl_block_t physicalBlockId);
+	fwl_block_t getActiveBlockHeader();
+	bool activateVirtualBlock(fwl_block_t virtualBlockHeader);
+	bool readCompressedBlock(long addr, uint8_t* out);
+	const uint8_t* decompressedBlock(fwl_block_t physicalBlockId);
+	bool verifyBlock(fwl_block_t physicalBlockId);
+	void updateActiveBlock(uint16_t offset, const void* buf, int len);
+	bool activeBlockMatchesFlash();
 	int readBytesFromVBlock(const addr_info& virtualStartInfo, void* buf, long len);
+	void discardVirtualBlock(fwl_block_t virtualBlockId);
+	void discardRange(fwl_block_t virtualBlockId, uint16_t start, uint16_t end);
+	int findDiscardedRange(fwl_block_t virtualBlockId);
+	void dropDiscardedRange(fwl_block_t virtualBlockId);
+	void releasePhysicalBlock(fwl_block_t physicalBlockHeader);
+	bool writeActiveBlock(uint8_t placement);
+	fwl_block_t findFreeBlock(fwl_block_t currentPhysicalBlock, uint8_t placement);
+	bool updateHeat(fwl_block_t virtualBlockId);
+	void relocateColdBlock();
+	fwl_block_t findColdBlock(fwl_block_t target, uint16_t minSpread);
+	void migrateBlock(fwl_block_t virtualBlockId);
+	bool isCompressed(fwl_block_t virtualBlockId);
+	void recoverJournal(fwl_block_t journalBlockId);
+	int stageBlock(fwl_block_t virtualBlockId);
+	bool openJournal();
+	bool writeJournalEntry(fwl_block_t virtualBlockId, fwl_block_t physicalBlockId);
+	void endTransaction();
+	void unmapVirtualBlock(fwl_block_t virtualBlockId);
+	void adoptFreeBlock(fwl_block_t physicalBlockId);
+	void deactivateBlock();
+	bool holdForSnapshot(fwl_block_t virtualBlockId, fwl_block_t physicalBlockHeader);
+	bool snapshotAllows(fwl_block_t virtualBlockId, bool keepsOld);
+	void setActiveBlockHeader(fwl_block_t header);
+	void setBlockHeader(fwl_block_t physicalBlockId, fwl_block_t header);
+	void setBlockMap(fwl_block_t virtualBlockId, fwl_block_t physicalBlockHeader);
+	bool isErased(fwl_block_t physicalBlockId);
+	bool isBlank(fwl_block_t physicalBlockId);
+	void setErased(fwl_block_t physicalBlockId, bool erased);
+	void eraseBlock(fwl_block_t physicalBlockId);
+	void eraseIfDirty(fwl_block_t physicalBlockId);
+	void rebuildFreeMap();
+	fwl_block_t nextFreeBlock(fwl_block_t physicalBlockId);
+	fwl_block_t nextBlockWith(const uint32_t* map, fwl_block_t block, const fwl_block_t* entries, fwl_block_t value);
+	fwl_block_t nextMapBit(const uint32_t* map, fwl_block_t block);
+	void setMapBit(uint32_t* map, fwl_block_t block, bool set);
 
 	virtual uint8_t flashReadByte(long addr) = 0;
 	virtual int flashReadBytes(long addr, void* buf, long len)=0;
@@ -40,46 +213,134 @@ protected:
 	virtual int flashWriteBytes(long addr, const void* buf, int len)=0;
 	virtual int flashChipErase()=0;
 	virtual int flashBlockErase4K(long address)=0;
+	//size of the flash in bytes, 0 if unknown
+	virtual long flashSize()=0;
+	//deep power-down, the flash finishes running operations before it sleeps
+	virtual bool flashSleepDue()=0;
+	virtual void flashSleep()=0;
 
-	uint16_t blockCount;
+	fwl_block_t blockCount;
 	uint8_t activeBlock[4096];
 	bool activeBlockDirty;
 	//maps virtual block ids to real blocks (it contains block headers, encoding the physical block, the deleted bit normally = 1)
 	//for unused virtual blocks, it still contains a header pointing to a physical block, but with the deleted bit = 0
-	uint16_t* blockMap;
+	//during a transaction an unused virtual block may have no physical block (0xffff)
+	fwl_block_t* blockMap;
 	//array of the physical Block Headers needed for fast free block lookup
 	//it is the inverse of block Map, so for an empty physicalBlock it contains a virtual block id, and the deleted bit = 0
-	uint16_t* blockHeaderCache;
+	//a free physical block, which belongs to no virtual block, is 0xffff
+	fwl_block_t* blockHeaderCache;
+
+	//hot/cold separation
+	bool hotColdSeparation;
+	//per virtual block: decaying update frequency and the flushSequence of the last flush
+	uint8_t* blockHeat;
+	uint16_t* blockLastFlush;
+	uint16_t flushSequence;
+	uint8_t flushesSinceRelocation;
+	//per physical block: erases since startup
+	uint16_t* eraseCount;
+	//next virtual block, the search for a cold block looks at
+	fwl_block_t relocateCursor;
+	//expected duration of a migration by maintenance()
+	unsigned long migrationMicros;
+
+	//start of the leveler on the flash in bytes, the first block of its partition
+	long flashOffset;
+
+	//free physical blocks (BLOCK_IS_FREE(blockHeaderCache[i])) as bitmap, followed by a bitmap of the non zero words
+	uint32_t* freeMap;
+	fwl_block_t freeMapWords;
+	//the same for the free physical blocks without a virtual block (ErasedHeader), the virtual blocks without a
+	//physical block (ErasedHeader in blockMap) and the blocks held for the snapshot
+	uint32_t* unownedMap;
+	uint32_t* unmappedMap;
+	uint32_t* heldMap;
+	//number of free physical blocks, kept by setBlockHeader()
+	fwl_block_t freeBlocks;
+	//physical blocks known to be erased, behind the free bitmaps. Released blocks stay dirty until they get reused,
+	//format() only erases the dirty ones. Rebuilt from the headers by initialize(), a block with data has one
+	uint32_t* erasedMap;
+	bool erasedMapValid;
+
+	//compression
+	bool compression;
+	uint8_t* compressBuffer;
+	//physical block, whose data the compressBuffer holds decompressed for reads. ErasedHeader if none
+	fwl_block_t compressBufferBlock;
+
+	//checksums
+	bool verifyOnActivation;
+	bool verifyOnMount;
+
+	FlashWearLevelerStats stats;
+
+	//transactions
+	uint8_t txState;
+	bool txFailed;
+	//physical block of the journal, 0xffff if there is none
+	fwl_block_t journalBlock;
+	uint16_t journalEntries;
+	//the written virtual blocks and their blockMap entries before the transaction
+	uint8_t txCount;
+	fwl_block_t txVirtual[FWL_MAX_TX_BLOCKS];
+	fwl_block_t txOld[FWL_MAX_TX_BLOCKS];
+
+	//partial discards of inactive virtual blocks: the range [start, end) of the block
+	uint8_t discardedCount;
+	fwl_block_t discardedBlock[FWL_DISCARDED_RANGES];
+	uint16_t discardedStart[FWL_DISCARDED_RANGES];
+	uint16_t discardedEnd[FWL_DISCARDED_RANGES];
+
+	//the block map of the snapshot, 0 if there is none
+	fwl_block_t* snapshot;
+	//free blocks reserved for the rewrites of the blocks, which the snapshot references and which aren't held yet
+	fwl_block_t snapshotReserve;
 };
 
-template<typename Flash, int noOf4kBlocks>
+//compressed adds the 4096 byte compression buffer. wearTracking adds the block heats, last flushes and erase counts
+//(5 bytes per block), which hot/cold separation and maintenance() need
+template<typename Flash, int noOf4kBlocks, bool compressed=false, bool wearTracking=false>
 class FlashWearLeveler: public FlashWearLevelerBase {
 public:
-	 FlashWearLeveler(Flash& _flash):FlashWearLevelerBase(noOf4kBlocks, bM, bMC), flash(_flash) {}
+	//firstBlock is the start of the partition (see FlashPartition.h). Levelers of different partitions share the flash
+	FlashWearLeveler(Flash& _flash, long firstBlock=0):FlashWearLevelerBase(noOf4kBlocks, bM, bMC,
+			wearTracking ? bH : 0, wearTracking ? bLF : 0, wearTracking ? bEC : 0, compressed ? cB : 0, fM,
+			firstBlock * 4096), flash(_flash) {}
 protected:
-	virtual uint8_t flashReadByte(long addr) { return flash.readByte(addr); }
-	virtual int flashReadBytes(long addr, void* buf, long len) { flash.readBytes(addr, buf, len); return 0; }
-	virtual int flashWriteByte(long addr, uint8_t byt) { flash.writeByte(addr, byt); return 0; }
-	virtual int flashWriteBytes(long addr, const void* buf, int len){ flash.writeBytes(addr, buf, len); return 0; }
+	virtual uint8_t flashReadByte(long addr) {
+		stats.bytesRead++;
+		return flash.readByte(flashOffset + addr);
+	}
+	virtual int flashReadBytes(long addr, void* buf, long len) {
+		stats.bytesRead += len;
+		flash.readBytes(flashOffset + addr, buf, len);
+		return 0;
+	}
+	virtual int flashWriteByte(long addr, uint8_t byt) { flash.writeByte(flashOffset + addr, byt); return 0; }
+	virtual int flashWriteBytes(long addr, const void* buf, int len){ flash.writeBytes(flashOffset + addr, buf, len); return 0; }
 	virtual int flashChipErase() {
-		Serial.println("Erase");
 		flash.chipErase();
-		while(flash.busy()) {
-			Serial.println("Wait for erase");
-		}
+		flash.waitIdle();
 		return 0;
 	}
+	virtual long flashSize() { return flash.getCapacity(); }
 	virtual int flashBlockErase4K(long address) {
-		flash.blockErase4K(address); return 0;
-		while(flash.busy()) {
-			Serial.println("Wait for block erase");
-		}
+		//don't wait for the erase to finish, the next command will do that
+		flash.blockErase4K(flashOffset + address);
 		return 0;
 	}
+	virtual bool flashSleepDue() { return flash.sleepDue(); }
+	virtual void flashSleep() { flash.sleep(); }
 
 	Flash& flash;
-	uint16_t bM[noOf4kBlocks];
-	uint16_t bMC[noOf4kBlocks];
+	fwl_block_t bM[noOf4kBlocks];
+	fwl_block_t bMC[noOf4kBlocks];
+	uint8_t bH[wearTracking ? noOf4kBlocks : 1];
+	uint16_t bLF[wearTracking ? noOf4kBlocks : 1];
+	uint16_t bEC[wearTracking ? noOf4kBlocks : 1];
+	uint8_t cB[compressed ? 4096 : 1];
+	uint32_t fM[FWL_FREE_MAP_WORDS(noOf4kBlocks)];
 };
 
 #endif
@@ -38,6 +38,28 @@
                                               // Example for Atmel-Adesto 4Mbit AT25DF041A: 0x1F44 (page 27: http://www.adestotech.com/sites/default/files/datasheets/doc3668.pdf)
                                               // Example for Winbond 4Mbit W25X40CL: 0xEF30 (page 14: http://www.winbond.com/NR/rdonlyres/6E25084C-0BFE-4B25-903D-AE10221A0929/0/W25X40CL.pdf)
 #define SPIFLASH_MACREAD          0x4B        // read unique ID number (MAC)
+#define SPIFLASH_SFDPREAD         0x5A        // read the serial flash discoverable parameters (need to add 1 dummy byte after 3 address bytes)
+#define SPIFLASH_SUSPEND          0x75        // suspend a running erase, the array can be read afterwards
+#define SPIFLASH_RESUME           0x7A        // resume a suspended erase
+#define SPIFLASH_ENTER4BYTE       0xB7        // switch to 4 byte addresses for all commands, needed above 16MB
+
+#define SPIFLASH_PAGESIZE         256         // default page size, if the chip has no SFDP table
+
+/// typical and maximum operation times in microseconds (worst case of the supported chips)
+/// up to the typical time the chip is not asked at all, after the maximum time it is known to be done
+#define SPIFLASH_TIME_PAGEPROGRAM_TYP     700
+#define SPIFLASH_TIME_PAGEPROGRAM_MAX     3000
+#define SPIFLASH_TIME_BLOCKERASE_4K_TYP   45000
+#define SPIFLASH_TIME_BLOCKERASE_4K_MAX   400000
+#define SPIFLASH_TIME_BLOCKERASE_32K_TYP  120000
+#define SPIFLASH_TIME_BLOCKERASE_32K_MAX  1600000
+#define SPIFLASH_TIME_CHIPERASE_TYP       2000000
+#define SPIFLASH_TIME_CHIPERASE_MAX       100000000
+#define SPIFLASH_TIME_STATUSWRITE_TYP     10000
+#define SPIFLASH_TIME_STATUSWRITE_MAX     15000
+#define SPIFLASH_TIME_SUSPEND         20          // max time until the chip is suspended (tSUS)
+#define SPIFLASH_TIME_RESUMETOSUSPEND 20          // min time between a resume and the next suspend, the erase needs to progress
+#define SPIFLASH_TIME_RES1            30          // max time from a wake up until the chip accepts commands (tRES1 3us on winbond, tRDPD 30us on AT25DF041A)
 
 //#define DBG()
 //#define DBG()
@@ -56,20 +78,68 @@ byte SPIFlash::UNIQUEID[8];
 SPIFlash::SPIFlash(uint8_t slaveSelectPin, uint16_t jedecID) {
   _slaveSelectPin = slaveSelectPin;
   _wantedJedecID = jedecID;
+  _opPending = false;
+  _autoSuspend = false;
+  _suspended = false;
+  _resumeTime = 0;
+  _maxInterruptOff = 0;
+  _selected = false;
+  _worstInterruptOff = 0;
+  _asleep = false;
+  _sleepTimeout = 0;
+  _lastActivity = 0;
+  _sleeps = 0;
+  _wakeups = 0;
+
+  memset(&_params, 0, sizeof(_params));
+  _params.pageSize = SPIFLASH_PAGESIZE;
+  _params.erase4KOpcode = SPIFLASH_BLOCKERASE_4K;
+  _params.addressBytes = 3;
 }
 
-/// Select the flash chip
+/// Select the flash chip, a sleeping chip gets woken up first
 void SPIFlash::select() {
+  if (_asleep) wakeup();
   noInterrupts();
+  if (!_selected) {
+    _selected = true;
+    // only timed with a limit, micros() costs on every transaction, even every AAI byte pair
+    if (_maxInterruptOff) _selectTime = micros();
+  }
   digitalWrite(_slaveSelectPin, LOW);
 }
 
 /// UNselect the flash chip
 void SPIFlash::unselect() {
   digitalWrite(_slaveSelectPin, HIGH);
+  if (_selected) {
+    _selected = false;
+    if (_maxInterruptOff || _sleepTimeout) {
+      unsigned long now = micros();
+      _lastActivity = now;
+      if (_maxInterruptOff && now - _selectTime > _worstInterruptOff) _worstInterruptOff = now - _selectTime;
+    }
+  }
   interrupts();
 }
 
+/// bound the time interrupts are disabled during long reads (0 = no limit, the default)
+/// reads get split into several read commands, interrupts are enabled in between
+/// program commands are at most one page long and not split any further
+void SPIFlash::setMaxInterruptOffTime(unsigned long maxMicros) {
+  _maxInterruptOff = maxMicros;
+}
+
+/// worst case time in microseconds, the chip was selected with interrupts disabled
+/// only measured while a limit is set
+unsigned long SPIFlash::getMaxInterruptOffTime() {
+  return _worstInterruptOff;
+}
+
+void SPIFlash::resetInterruptOffTime() {
+  _worstInterruptOff = 0;
+}
+
 /// setup SPI, read device ID etc...
 boolean SPIFlash::initialize()
 {
@@ -80,6 +150,11 @@ boolean SPIFlash::initialize()
   SPI.setClockDivider(SPI_CLOCK_DIV2); //max speed, except on Due which can run at system clock speed
   SPI.begin();
 
+  // we don't know what the chip did before a reset, so poll it before the first command
+  // it may also still be in deep power-down, where it doesn't even answer status reads
+  startOperation(0, 0xFFFFFFFF);
+  _asleep = true;
+
   byte status=readStatus();
   if(status & 0x02) {
 	  Serial.println("device initialized in WREN mode. resetting...");
@@ -98,11 +173,24 @@ boolean SPIFlash::initialize()
   }
   if(_deviceJedecID == 0) exit(1);
 
+  readSFDP();
+
+  // chips above 16MB can only reach their upper half with 4 byte addresses
+  if (_params.capacity > 0x1000000L && _params.supports4ByteAddress && _params.addressBytes == 3) {
+    command(SPIFLASH_ENTER4BYTE, true);
+    unselect();
+    select();
+    SPI.transfer(SPIFLASH_WRITEDISABLE);
+    unselect();
+    _params.addressBytes = 4;
+  }
+
 
   if (_wantedJedecID == 0 || _deviceJedecID == _wantedJedecID) {
     command(SPIFLASH_STATUSWRITE, true); // Write Status Register
     SPI.transfer(0);                     // Global Unprotect
     unselect();
+    startOperation(SPIFLASH_TIME_STATUSWRITE_TYP, SPIFLASH_TIME_STATUSWRITE_MAX);
     return true;
   }
   return false;
@@ -118,6 +206,91 @@ uint16_t SPIFlash::readDeviceId()
   return jedecid;
 }
 
+/// send an address in the current addressing mode
+void SPIFlash::transferAddress(long addr)
+{
+  if (_params.addressBytes == 4) SPI.transfer(addr >> 24);
+  SPI.transfer(addr >> 16);
+  SPI.transfer(addr >> 8);
+  SPI.transfer(addr);
+}
+
+/// read from the SFDP address space
+void SPIFlash::readSFDPBytes(long addr, void* buf, word len)
+{
+  command(SPIFLASH_SFDPREAD);
+  SPI.transfer(addr >> 16);
+  SPI.transfer(addr >> 8);
+  SPI.transfer(addr);
+  SPI.transfer(0); //"dont care"
+  for (word i = 0; i < len; ++i)
+    ((byte*) buf)[i] = SPI.transfer(0);
+  unselect();
+}
+
+/// little endian dword i (1 based, like in JESD216) of a parameter table
+static uint32_t sfdpDword(const byte* table, byte i)
+{
+  const byte* d = table + (i - 1) * 4;
+  return (uint32_t)d[0] | ((uint32_t)d[1] << 8) | ((uint32_t)d[2] << 16) | ((uint32_t)d[3] << 24);
+}
+
+/// read chip size, page size, erase types and read modes from the basic flash parameter table
+/// returns false if the chip has no SFDP table, the defaults stay in place then
+boolean SPIFlash::readSFDP()
+{
+  byte header[16];
+  readSFDPBytes(0, header, sizeof(header));
+  if (header[0] != 'S' || header[1] != 'F' || header[2] != 'D' || header[3] != 'P')
+    return false;
+
+  // the first parameter header always points to the JEDEC basic flash parameter table
+  byte dwords = header[8 + 3];
+  long tableAddr = (long)header[8 + 4] | ((long)header[8 + 5] << 8) | ((long)header[8 + 6] << 16);
+  byte table[16 * 4];
+  if (header[8] != 0 || dwords < 9) return false;
+  if (dwords > 16) dwords = 16;
+  memset(table, 0xff, sizeof(table));
+  readSFDPBytes(tableAddr, table, dwords * 4);
+
+  uint32_t dw = sfdpDword(table, 1);
+  if ((dw & 0x03) == 0x01) _params.erase4KOpcode = dw >> 8;
+  _params.addressBytes = ((dw >> 17) & 0x03) == 0x02 ? 4 : 3;
+  _params.supports4ByteAddress = ((dw >> 17) & 0x03) != 0x00;
+  uint32_t modes = dw;
+
+  dw = sfdpDword(table, 2);
+  if (dw & 0x80000000UL) {
+    // 2^N bits. Bigger than what fits into a long
+    _params.capacity = (dw & 0x7fffffffUL) >= 34 ? 0x7fffffffL : (long)((1ULL << (dw & 0x7fffffffUL)) / 8);
+  } else {
+    _params.capacity = (long)((dw + 1ULL) / 8);
+  }
+
+  // read modes: dummy clocks in bits 4:0, mode clocks in bits 7:5, opcode in bits 15:8
+  dw = sfdpDword(table, 3);
+  if (modes & (1UL << 21)) { _params.read144Opcode = dw >> 8; _params.read144Dummy = (dw & 0x1f) + ((dw >> 5) & 0x07); }
+  if (modes & (1UL << 22)) { _params.read114Opcode = dw >> 24; _params.read114Dummy = ((dw >> 16) & 0x1f) + ((dw >> 21) & 0x07); }
+  dw = sfdpDword(table, 4);
+  if (modes & (1UL << 16)) { _params.read112Opcode = dw >> 8; _params.read112Dummy = (dw & 0x1f) + ((dw >> 5) & 0x07); }
+  if (modes & (1UL << 20)) { _params.read122Opcode = dw >> 24; _params.read122Dummy = ((dw >> 16) & 0x1f) + ((dw >> 21) & 0x07); }
+
+  // erase types: size as 2^N, then the opcode
+  for (byte i = 0; i < 4; i++) {
+    dw = sfdpDword(table, 8 + i / 2) >> ((i & 1) * 16);
+    byte shift = dw & 0xff;
+    _params.eraseSizeShift[i] = shift;
+    _params.eraseOpcode[i] = shift ? (dw >> 8) & 0xff : 0;
+    if (shift == 12 && (sfdpDword(table, 1) & 0x03) != 0x01) _params.erase4KOpcode = _params.eraseOpcode[i];
+  }
+
+  // the page size came with JESD216A
+  if (dwords >= 11) {
+    _params.pageSize = 1 << ((sfdpDword(table, 11) >> 4) & 0x0f);
+  }
+  return true;
+}
+
 /// Get the 64 bit unique identifier, stores it in UNIQUEID[8]. Only needs to be called once, ie after initialize
 /// Returns the byte pointer to the UNIQUEID byte array
 /// Read UNIQUEID like this:
@@ -139,25 +312,32 @@ byte* SPIFlash::readUniqueId()
 
 /// read 1 byte from flash memory
 byte SPIFlash::readByte(long addr) {
+  boolean suspended = _autoSuspend && suspend();
   command(SPIFLASH_ARRAYREADLOWFREQ);
-  SPI.transfer(addr >> 16);
-  SPI.transfer(addr >> 8);
-  SPI.transfer(addr);
+  transferAddress(addr);
   byte result = SPI.transfer(0);
   unselect();
+  if (suspended) resume();
   return result;
 }
 
 /// read unlimited # of bytes
 void SPIFlash::readBytes(long addr, void* buf, word len) {
-  command(SPIFLASH_ARRAYREAD);
-  SPI.transfer(addr >> 16);
-  SPI.transfer(addr >> 8);
-  SPI.transfer(addr);
-  SPI.transfer(0); //"dont care"
-  for (word i = 0; i < len; ++i)
-    ((byte*) buf)[i] = SPI.transfer(0);
-  unselect();
+  boolean suspended = _autoSuspend && suspend();
+  word i = 0;
+  do {
+    long a = addr + i;
+    command(SPIFLASH_ARRAYREAD);
+    transferAddress(a);
+    SPI.transfer(0); //"dont care"
+    while (i < len) {
+      ((byte*) buf)[i++] = SPI.transfer(0);
+      // check the time every 16 bytes and continue with a new burst, if the interrupts were off for too long
+      if (_maxInterruptOff && (i & 15) == 0 && micros() - _selectTime >= _maxInterruptOff) break;
+    }
+    unselect();
+  } while (i < len);
+  if (suspended) resume();
 }
 
 /// Send a command to the flash chip, pass TRUE for isWrite when its a write command
@@ -166,7 +346,8 @@ void SPIFlash::command(byte cmd, boolean isWrite){
   DDRB |= B00000001;            // Make sure the SS pin (PB0 - used by RFM12B on MoteinoLeo R1) is set as output HIGH!
   PORTB |= B00000001;
 #endif
-  while(busy()); //wait for any write/erase to complete
+  if (isWrite && _suspended) resume(); //no programming while an erase is suspended
+  waitIdle(); //wait for any write/erase to complete
 
   if (isWrite)
   {
@@ -188,7 +369,80 @@ boolean SPIFlash::busy()
   unselect();
   return status & 1;
   */
-  return readStatus() & 1;
+  boolean isBusy = readStatus() & 1;
+  if (!isBusy) _opPending = false;
+  return isBusy;
+}
+
+/// remember that the chip started a program/erase operation
+void SPIFlash::startOperation(unsigned long typicalMicros, unsigned long maxMicros, boolean suspendable) {
+  _opPending = true;
+  _opStart = micros();
+  _opTypicalMicros = typicalMicros;
+  _opMaxMicros = maxMicros;
+  _opSuspendable = suspendable;
+}
+
+/// check without any bus traffic, if the chip is known to be idle
+/// returns false, if an operation was started, that may still be running
+/// the chip isn't polled: an operation counts as running until its maximum time is over, even if it finished
+/// after the typical time. busy() and waitIdle() poll, sleepDue() polls after the typical time
+boolean SPIFlash::isIdle()
+{
+  if (_opPending && micros() - _opStart >= _opMaxMicros)
+    _opPending = false;
+  return !_opPending;
+}
+
+/// wait for a running program/erase operation to complete
+/// the status register is only polled, if the operation may still be in flight
+void SPIFlash::waitIdle()
+{
+  if (isIdle()) return;
+  // it is too early to ask, before the typical time is over
+  while (micros() - _opStart < _opTypicalMicros);
+  while (busy());
+}
+
+/// suspend a running 4K/32K erase, so that the array can be read while it is pending
+/// returns true, if the chip is suspended afterwards. Call resume() to continue the erase
+/// programming is not possible while suspended, write commands resume automatically
+boolean SPIFlash::suspend()
+{
+  if (_suspended) return true;
+  if (isIdle() || !_opSuspendable) return false;
+  // the erase may be done before its maximum time, then there is nothing to suspend
+  if (!busy()) return false;
+  // after a resume the erase needs some time to progress, before it can be suspended again
+  while (micros() - _resumeTime < SPIFLASH_TIME_RESUMETOSUSPEND);
+  select();
+  SPI.transfer(SPIFLASH_SUSPEND);
+  unselect();
+  delayMicroseconds(SPIFLASH_TIME_SUSPEND);
+  // the erase may have finished right before the suspend, then the chip ignores it and the resume restarts
+  // the tracking needlessly, until the next poll finds it idle
+  while (busy());
+  _suspended = true;
+  return true;
+}
+
+/// resume a suspended erase
+void SPIFlash::resume()
+{
+  if (!_suspended) return;
+  select();
+  SPI.transfer(SPIFLASH_RESUME);
+  unselect();
+  _suspended = false;
+  _resumeTime = micros();
+  // the erase was running, when it got suspended. The remaining time is unknown, so poll on the next command
+  startOperation(0, _opMaxMicros, true);
+}
+
+/// if enabled, readByte()/readBytes() suspend a running erase instead of waiting for it
+void SPIFlash::setEraseSuspend(boolean enable)
+{
+  _autoSuspend = enable;
 }
 
 /// return the STATUS register
@@ -208,12 +462,10 @@ byte SPIFlash::readStatus()
 ///          use the block erase commands to first clear memory (write 0xFFs)
 void SPIFlash::writeByte(long addr, uint8_t byt) {
   command(SPIFLASH_BYTEPAGEPROGRAM, true);  // Byte/Page Program
-  SPI.transfer(addr >> 16);
-  SPI.transfer(addr >> 8);
-  SPI.transfer(addr);
+  transferAddress(addr);
   SPI.transfer(byt);
-  while(busy()){}
   unselect();
+  startOperation(SPIFLASH_TIME_PAGEPROGRAM_TYP, SPIFLASH_TIME_PAGEPROGRAM_MAX);
 }
 
 /// write 1-256 bytes to flash memory
@@ -243,9 +495,7 @@ void SPIFlash::writeBytes(long addr, const void* buf, int len) {
 		if(needAddress) {
 			//Serial.println("Start AAI");
 			command(SPIFLASH_AAI_PROGRAM, true);
-			SPI.transfer(addr >> 16);
-			SPI.transfer(addr >> 8);
-			SPI.transfer(addr);
+			transferAddress(addr);
 			needAddress = false;
 		} else {
 			//Serial.println("Continue AAI");
@@ -265,8 +515,8 @@ void SPIFlash::writeBytes(long addr, const void* buf, int len) {
 	//Serial.println("End AAI");
 	select();
 	SPI.transfer(SPIFLASH_WRITEDISABLE);
-	while(busy()){}
 	unselect();
+	while(busy()){}
 
 	//write possible last byte
 	if(len > 0) {
@@ -275,13 +525,21 @@ void SPIFlash::writeBytes(long addr, const void* buf, int len) {
 	}
 
   } else {
-    command(SPIFLASH_BYTEPAGEPROGRAM, true);  // Byte/Page Program
-    SPI.transfer(addr >> 16);
-    SPI.transfer(addr >> 8);
-    SPI.transfer(addr);
-    for (uint8_t i = 0; i < len; i++)
-      SPI.transfer(((byte*) buf)[i]);
-    unselect();
+    const byte* bytes = (const byte*)buf;
+    while (len > 0) {
+      // split at page boundaries, the chip would wrap around otherwise
+      int n = _params.pageSize - (addr & (_params.pageSize - 1));
+      if (n > len) n = len;
+      command(SPIFLASH_BYTEPAGEPROGRAM, true);  // Byte/Page Program
+      transferAddress(addr);
+      for (int i = 0; i < n; i++)
+        SPI.transfer(bytes[i]);
+      unselect();
+      startOperation(SPIFLASH_TIME_PAGEPROGRAM_TYP, SPIFLASH_TIME_PAGEPROGRAM_MAX);
+      addr += n;
+      bytes += n;
+      len -= n;
+    }
   }
 }
 
@@ -294,34 +552,66 @@ void SPIFlash::writeBytes(long addr, const void* buf, int len) {
 void SPIFlash::chipErase() {
   command(SPIFLASH_CHIPERASE, true);
   unselect();
+  startOperation(SPIFLASH_TIME_CHIPERASE_TYP, SPIFLASH_TIME_CHIPERASE_MAX);
 }
 
 /// erase a 4Kbyte block
 void SPIFlash::blockErase4K(long addr) {
-  command(SPIFLASH_BLOCKERASE_4K, true); // Block Erase
-  SPI.transfer(addr >> 16);
-  SPI.transfer(addr >> 8);
-  SPI.transfer(addr);
+  command(_params.erase4KOpcode, true); // Block Erase
+  transferAddress(addr);
   unselect();
+  startOperation(SPIFLASH_TIME_BLOCKERASE_4K_TYP, SPIFLASH_TIME_BLOCKERASE_4K_MAX, true);
 }
 
 /// erase a 32Kbyte block
 void SPIFlash::blockErase32K(long addr) {
   command(SPIFLASH_BLOCKERASE_32K, true); // Block Erase
-  SPI.transfer(addr >> 16);
-  SPI.transfer(addr >> 8);
-  SPI.transfer(addr);
+  transferAddress(addr);
   unselect();
+  startOperation(SPIFLASH_TIME_BLOCKERASE_32K_TYP, SPIFLASH_TIME_BLOCKERASE_32K_MAX, true);
 }
 
+/// enter deep power-down. A running program/erase is finished first, as the chip ignores the command while busy
 void SPIFlash::sleep() {
-  command(SPIFLASH_SLEEP); // Block Erase
+  if (_asleep) return;
+  if (_suspended) resume();
+  command(SPIFLASH_SLEEP);
   unselect();
+  _asleep = true;
+  _sleeps++;
 }
 
+/// leave deep power-down. Not needed before commands, they wake up the chip on their own
 void SPIFlash::wakeup() {
-  command(SPIFLASH_WAKE); // Block Erase
+  if (!_asleep) return;
+  _asleep = false;
+  select();
+  SPI.transfer(SPIFLASH_WAKE);
   unselect();
+  // the chip ignores commands until tRES1 is over
+  delayMicroseconds(SPIFLASH_TIME_RES1);
+  _wakeups++;
+}
+
+void SPIFlash::setAutoSleep(unsigned long idleMicros) {
+  _sleepTimeout = idleMicros;
+  // transactions aren't timed without a timeout, start counting now
+  _lastActivity = micros();
+}
+
+/// true, if auto sleep is enabled and the chip has been idle for the timeout
+/// a program/erase, which may still be running, is polled after its typical time
+boolean SPIFlash::sleepDue() {
+  if (!_sleepTimeout || _asleep || _suspended) return false;
+  if (!isIdle() && (micros() - _opStart < _opTypicalMicros || busy())) return false;
+  return micros() - _lastActivity >= _sleepTimeout;
+}
+
+/// call this regularly while the application has nothing to do, it enters deep power-down once sleepDue()
+/// returns true, if the chip is asleep
+boolean SPIFlash::idle() {
+  if (sleepDue()) sleep();
+  return _asleep;
 }
 
 /// cleanup
@@ -45,6 +45,27 @@
 ///  Chip Erase operation completes successfully or aborts
 ///  Hold condition aborts
                                               
+/// Chip parameters. initialize() reads them from the SFDP table (JESD216), if the chip has one.
+/// Otherwise the defaults of the original 256byte/page chips are used
+struct SPIFlashParams {
+  long capacity;              // in bytes, 0 if unknown
+  word pageSize;              // a program command must not cross a page boundary
+  byte erase4KOpcode;
+  byte eraseOpcode[4];        // the erase types of the chip, 0 if unused
+  byte eraseSizeShift[4];     // log2 of the erase type sizes
+  byte addressBytes;          // 3, or 4 if the chip only supports 4 byte addresses
+  boolean supports4ByteAddress;
+  // multi io reads. The Arduino SPI library only does single io, so they are informational
+  byte read112Opcode;         // 0 if not supported
+  byte read112Dummy;          // dummy + mode clocks
+  byte read122Opcode;
+  byte read122Dummy;
+  byte read114Opcode;
+  byte read114Dummy;
+  byte read144Opcode;
+  byte read144Dummy;
+};
+
 class SPIFlash {
 public:
   static byte UNIQUEID[8];
@@ -57,21 +78,65 @@ public:
   void writeByte(long addr, byte byt);
   void writeBytes(long addr, const void* buf, int len);
   boolean busy();
+  boolean isIdle();
+  void waitIdle();
+  boolean suspend();
+  void resume();
+  void setEraseSuspend(boolean enable);
+  void setMaxInterruptOffTime(unsigned long maxMicros);
+  unsigned long getMaxInterruptOffTime();
+  void resetInterruptOffTime();
   void chipErase();
   void blockErase4K(long address);
   void blockErase32K(long address);
   uint16_t readDeviceId();
   byte* readUniqueId();
+  boolean readSFDP();
+  const SPIFlashParams& getParams() { return _params; }
+  long getCapacity() { return _params.capacity; }
   
+  /// deep power-down. Every command wakes the chip up again, so wakeup() doesn't need to be called
   void sleep();
   void wakeup();
+  boolean isAsleep() { return _asleep; }
+  /// enter deep power-down from idle(), after the chip was idle for idleMicros (0 = never, the default)
+  void setAutoSleep(unsigned long idleMicros);
+  boolean sleepDue();
+  boolean idle();
+  unsigned long getSleepCount() { return _sleeps; }
+  unsigned long getWakeupCount() { return _wakeups; }
   void end();
 protected:
   void select();
   void unselect();
+  void startOperation(unsigned long typicalMicros, unsigned long maxMicros, boolean suspendable=false);
+  void readSFDPBytes(long addr, void* buf, word len);
+  void transferAddress(long addr);
   byte _slaveSelectPin;
   uint16_t _wantedJedecID;
   uint16_t _deviceJedecID;
+  SPIFlashParams _params;
+  /// program/erase operation in flight, started at _opStart
+  boolean _opPending;
+  unsigned long _opStart;
+  unsigned long _opTypicalMicros;
+  unsigned long _opMaxMicros;
+  boolean _opSuspendable;
+  /// erase suspend state
+  boolean _autoSuspend;
+  boolean _suspended;
+  unsigned long _resumeTime;
+  /// interrupts are disabled while the chip is selected. Long reads get split to stay below _maxInterruptOff
+  unsigned long _maxInterruptOff;
+  boolean _selected;
+  unsigned long _selectTime;
+  unsigned long _worstInterruptOff;
+  /// deep power-down state. _lastActivity is the end of the last bus transaction
+  boolean _asleep;
+  unsigned long _sleepTimeout;
+  unsigned long _lastActivity;
+  unsigned long _sleeps;
+  unsigned long _wakeups;
 };
 
 #endif
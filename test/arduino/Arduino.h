@@ -0,0 +1,46 @@
+#ifndef _ARDUINO_H_
+#define _ARDUINO_H_
+
+//minimal host replacement of the arduino core, just enough to run SPIFlash against FlashSim
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef uint16_t word;
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+void noInterrupts();
+void interrupts();
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+class HardwareSerial {
+public:
+	void begin(long) {}
+	void printf(const char* fmt, ...) {
+		va_list ap;
+		va_start(ap, fmt);
+		vprintf(fmt, ap);
+		va_end(ap);
+	}
+	void print(const char* s) { fputs(s, stdout); }
+	void println(const char* s = "") { puts(s); }
+	void flush() { fflush(stdout); }
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,318 @@
+#include "FlashSim.h"
+#include <SPI.h>
+#include <assert.h>
+
+#define SIM_WRITEENABLE      0x06
+#define SIM_WRITEDISABLE     0x04
+#define SIM_BLOCKERASE_4K    0x20
+#define SIM_BLOCKERASE_32K   0x52
+#define SIM_BLOCKERASE_64K   0xD8
+#define SIM_CHIPERASE        0x60
+#define SIM_CHIPERASE2       0xC7
+#define SIM_STATUSREAD       0x05
+#define SIM_STATUSWRITE      0x01
+#define SIM_ARRAYREAD        0x0B
+#define SIM_ARRAYREADLOWFREQ 0x03
+#define SIM_SLEEP            0xB9
+#define SIM_WAKE             0xAB
+#define SIM_BYTEPAGEPROGRAM  0x02
+#define SIM_IDREAD           0x9F
+#define SIM_MACREAD          0x4B
+#define SIM_SFDPREAD         0x5A
+#define SIM_SUSPEND          0x75
+#define SIM_RESUME           0x7A
+#define SIM_ENTER4BYTE       0xB7
+#define SIM_EXIT4BYTE        0xE9
+
+HardwareSerial Serial;
+SPIClass SPI;
+FlashSim* FlashSim::current = 0;
+
+unsigned long simMicros = 0;
+unsigned long simMaxMaskedMicros = 0;
+static unsigned long maskedSince;
+static bool masked = false;
+
+void pinMode(uint8_t, uint8_t) {}
+
+//the flash is the only device on the bus, so every pin is its chip select
+void digitalWrite(uint8_t, uint8_t val) {
+	assert(FlashSim::current);
+	if(val == LOW) {
+		FlashSim::current->select();
+	} else {
+		FlashSim::current->unselect();
+	}
+}
+
+void noInterrupts() {
+	if(!masked) {
+		masked = true;
+		maskedSince = simMicros;
+	}
+}
+
+void interrupts() {
+	if(masked) {
+		masked = false;
+		if(simMicros - maskedSince > simMaxMaskedMicros) {
+			simMaxMaskedMicros = simMicros - maskedSince;
+		}
+	}
+}
+
+unsigned long micros() { return simMicros++; }
+unsigned long millis() { return simMicros / 1000; }
+void delay(unsigned long ms) { simMicros += ms * 1000; }
+void delayMicroseconds(unsigned int us) { simMicros += us; }
+
+uint8_t SPIClass::transfer(uint8_t data) {
+	assert(FlashSim::current);
+	return FlashSim::current->transfer(data);
+}
+
+
+FlashSim::FlashSim(long _size, uint16_t _jedecId): size(_size), jedecId(_jedecId) {
+	memory = (uint8_t*)malloc(size);
+	memset(memory, 0xff, size);
+	sfdp = 0;
+	sfdpLen = 0;
+	pageSize = 256;
+	erase4KOpcode = SIM_BLOCKERASE_4K;
+	programTime = 700;
+	erase4KTime = 45000;
+	erase32KTime = 120000;
+	erase64KTime = 150000;
+	chipEraseTime = 2000000;
+	statusWriteTime = 10000;
+	suspendLatency = 20;
+	wakeLatency = 3;
+	eraseRunning = false;
+	suspended = false;
+	selected = false;
+	wel = false;
+	fourByteMode = false;
+	deepPowerDown = false;
+	awakeAt = 0;
+	busyUntil = 0;
+	resetCounters();
+	current = this;
+}
+
+FlashSim::~FlashSim() {
+	free(memory);
+	if(current == this) current = 0;
+}
+
+void FlashSim::resetCounters() {
+	transactions = 0;
+	statusReads = 0;
+	bytesTransferred = 0;
+	programs = 0;
+	erases = 0;
+	suspends = 0;
+	busyViolations = 0;
+	sleeps = 0;
+	wakeups = 0;
+	sleepViolations = 0;
+	sleepTime = 0;
+}
+
+bool FlashSim::isBusy() {
+	return simMicros < busyUntil;
+}
+
+void FlashSim::startOperation(unsigned long duration, bool erase) {
+	busyUntil = simMicros + duration;
+	eraseRunning = erase;
+	wel = false;
+}
+
+void FlashSim::select() {
+	if(selected) return;
+	selected = true;
+	transactions++;
+	pos = 0;
+	addr = 0;
+	pageLen = 0;
+	ignored = false;
+}
+
+void FlashSim::unselect() {
+	if(!selected) return;
+	selected = false;
+	if(pos > 0 && !ignored) {
+		finishCommand();
+	}
+}
+
+uint8_t FlashSim::transfer(uint8_t data) {
+	simMicros++;
+	bytesTransferred++;
+	if(!selected) return 0xff;
+
+	long p = pos++;
+	if(p == 0) {
+		cmd = data;
+		if(cmd == erase4KOpcode) {
+			cmd = SIM_BLOCKERASE_4K;
+		} else if(cmd == SIM_BLOCKERASE_4K) {
+			//not the opcode of this chip
+			cmd = 0;
+		}
+		if(deepPowerDown ? cmd != SIM_WAKE : simMicros < awakeAt) {
+			//a sleeping chip only listens to the wake up command
+			sleepViolations++;
+			ignored = true;
+		} else if(cmd == SIM_STATUSREAD || cmd == SIM_SUSPEND || cmd == SIM_WAKE) {
+			//a wake up of a chip, which is awake, does nothing
+			if(cmd == SIM_STATUSREAD) statusReads++;
+		} else if(isBusy()) {
+			busyViolations++;
+			ignored = true;
+		} else if(suspended && cmd != SIM_RESUME && cmd != SIM_ARRAYREAD && cmd != SIM_ARRAYREADLOWFREQ) {
+			//only reads are allowed during a suspended erase
+			busyViolations++;
+			ignored = true;
+		}
+		return 0xff;
+	}
+	if(ignored) return 0xff;
+
+	//reads, programs and erases send 3 or 4 address bytes after the command
+	long addrEnd = fourByteMode ? 5 : 4;
+	switch(cmd) {
+	case SIM_STATUSREAD:
+		return (isBusy() ? 0x01 : 0) | (wel ? 0x02 : 0);
+	case SIM_IDREAD:
+		if(p == 1) return jedecId >> 8;
+		if(p == 2) return jedecId & 0xff;
+		return 0;
+	case SIM_MACREAD:
+		//4 dummy bytes, then the id
+		return p < 5 ? 0 : 0x10 + p;
+	case SIM_ARRAYREADLOWFREQ:
+	case SIM_ARRAYREAD: {
+		long dataStart = cmd == SIM_ARRAYREAD ? addrEnd + 1 : addrEnd;
+		if(p < addrEnd) {
+			addr = (addr << 8) | data;
+			return 0xff;
+		}
+		if(p < dataStart) return 0xff;
+		return memory[(addr + p - dataStart) % size];
+	}
+	case SIM_SFDPREAD:
+		if(p < 4) {
+			addr = (addr << 8) | data;
+			return 0xff;
+		}
+		if(p < 5 || addr + p - 5 >= sfdpLen) return 0xff;
+		return sfdp[addr + p - 5];
+	case SIM_BYTEPAGEPROGRAM:
+		if(p < addrEnd) {
+			addr = (addr << 8) | data;
+		} else {
+			//the page buffer wraps like on the real chip
+			int i = ((addr & (pageSize - 1)) + p - addrEnd) & (pageSize - 1);
+			if(p - addrEnd < pageSize) {
+				pageLen++;
+			}
+			page[i] = data;
+		}
+		return 0xff;
+	case SIM_BLOCKERASE_4K:
+	case SIM_BLOCKERASE_32K:
+	case SIM_BLOCKERASE_64K:
+		if(p < addrEnd) {
+			addr = (addr << 8) | data;
+		}
+		return 0xff;
+	default:
+		return 0xff;
+	}
+}
+
+void FlashSim::programPage() {
+	long base = addr & ~(long)(pageSize - 1);
+	int start = addr & (pageSize - 1);
+	for(int i=0; i<pageLen; i++) {
+		int o = (start + i) & (pageSize - 1);
+		memory[(base + o) % size] &= page[o];
+	}
+}
+
+void FlashSim::finishCommand() {
+	switch(cmd) {
+	case SIM_WRITEENABLE:
+		wel = true;
+		break;
+	case SIM_WRITEDISABLE:
+		wel = false;
+		break;
+	case SIM_STATUSWRITE:
+		if(wel) startOperation(statusWriteTime);
+		break;
+	case SIM_SLEEP:
+		deepPowerDown = true;
+		sleepStart = simMicros;
+		sleeps++;
+		break;
+	case SIM_ENTER4BYTE:
+		fourByteMode = true;
+		break;
+	case SIM_EXIT4BYTE:
+		fourByteMode = false;
+		break;
+	case SIM_SUSPEND:
+		if(isBusy() && eraseRunning && !suspended) {
+			remaining = busyUntil - simMicros;
+			suspended = true;
+			suspends++;
+			busyUntil = simMicros + suspendLatency;
+			eraseRunning = false;
+		}
+		break;
+	case SIM_RESUME:
+		if(suspended) {
+			suspended = false;
+			startOperation(remaining, true);
+		}
+		break;
+	case SIM_WAKE:
+		if(deepPowerDown) {
+			deepPowerDown = false;
+			sleepTime += simMicros - sleepStart;
+			awakeAt = simMicros + wakeLatency;
+			wakeups++;
+		}
+		break;
+	case SIM_BYTEPAGEPROGRAM:
+		if(wel && pos >= (fourByteMode ? 5 : 4)) {
+			programPage();
+			programs++;
+			startOperation(programTime);
+		}
+		break;
+	case SIM_BLOCKERASE_4K:
+	case SIM_BLOCKERASE_32K:
+	case SIM_BLOCKERASE_64K:
+		if(wel && pos >= (fourByteMode ? 5 : 4)) {
+			long blockSize = cmd == SIM_BLOCKERASE_4K ? 4096 : (cmd == SIM_BLOCKERASE_32K ? 32768 : 65536);
+			long start = (addr % size) & ~(blockSize - 1);
+			memset(memory + start, 0xff, blockSize);
+			erases++;
+			startOperation(cmd == SIM_BLOCKERASE_4K ? erase4KTime : (cmd == SIM_BLOCKERASE_32K ? erase32KTime : erase64KTime), true);
+		}
+		break;
+	case SIM_CHIPERASE:
+	case SIM_CHIPERASE2:
+		if(wel) {
+			memset(memory, 0xff, size);
+			erases++;
+			startOperation(chipEraseTime);
+		}
+		break;
+	default:
+		break;
+	}
+}
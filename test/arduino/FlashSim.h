@@ -0,0 +1,90 @@
+#ifndef _FLASH_SIM_H_
+#define _FLASH_SIM_H_
+
+#include <Arduino.h>
+
+//simulated spi nor flash chip behind the host SPI replacement
+//time is simulated too: every transferred byte and every call to micros() advances the clock by 1us
+class FlashSim {
+public:
+	FlashSim(long size, uint16_t jedecId);
+	~FlashSim();
+
+	void select();
+	void unselect();
+	uint8_t transfer(uint8_t data);
+	bool isBusy();
+	void resetCounters();
+
+	//the chip currently attached to the bus
+	static FlashSim* current;
+
+	uint8_t* memory;
+	long size;
+	uint16_t jedecId;
+	//SFDP table, reads as 0xff if not set
+	const uint8_t* sfdp;
+	int sfdpLen;
+	//programs wrap around at page boundaries, up to 256
+	int pageSize;
+	uint8_t erase4KOpcode;
+
+	//operation times in us
+	unsigned long programTime;
+	unsigned long erase4KTime;
+	unsigned long erase32KTime;
+	unsigned long erase64KTime;
+	unsigned long chipEraseTime;
+	unsigned long statusWriteTime;
+	//time from a suspend command until the array can be read (tSUS)
+	unsigned long suspendLatency;
+	//time from a wake up until the chip accepts commands again (tRES1)
+	unsigned long wakeLatency;
+
+	//bus statistics
+	unsigned long transactions;
+	unsigned long statusReads;
+	unsigned long bytesTransferred;
+	unsigned long programs;
+	unsigned long erases;
+	unsigned long suspends;
+	//commands (other than status reads) sent while the chip was busy. Those get ignored by real chips
+	unsigned long busyViolations;
+	//deep power-down: commands sent while asleep or before tRES1 was over, they get ignored too
+	unsigned long sleeps;
+	unsigned long wakeups;
+	unsigned long sleepViolations;
+	//total time spent in deep power-down
+	unsigned long sleepTime;
+protected:
+	void finishCommand();
+	void startOperation(unsigned long duration, bool erase=false);
+	void programPage();
+
+	bool selected;
+	bool wel;
+	//set by the enter 4 byte address mode command
+	bool fourByteMode;
+	bool deepPowerDown;
+	unsigned long sleepStart;
+	unsigned long awakeAt;
+	unsigned long busyUntil;
+	//erase suspend state
+	bool eraseRunning;
+	bool suspended;
+	unsigned long remaining;
+	//the current transaction
+	uint8_t cmd;
+	bool ignored;
+	long pos;
+	long addr;
+	uint8_t page[256];
+	int pageLen;
+};
+
+//simulated clock in us
+extern unsigned long simMicros;
+//longest time, interrupts were disabled in us
+extern unsigned long simMaxMaskedMicros;
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef _SPI_H_
+#define _SPI_H_
+
+#include <Arduino.h>
+
+#define SPI_MODE0 0
+#define MSBFIRST 1
+#define SPI_CLOCK_DIV2 2
+
+class SPIClass {
+public:
+	void begin() {}
+	void end() {}
+	void setDataMode(uint8_t) {}
+	void setBitOrder(uint8_t) {}
+	void setClockDivider(uint8_t) {}
+	uint8_t transfer(uint8_t data);
+};
+
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,208 @@
+//benchmarks of the wear leveler on DummyFlash
+#include "../DummyFlash.h"
+#include "../FlashWearLeveler.h"
+#include "../FlashCRC.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#define BLOCKS 64
+//virtual blocks in use, the rest stays free
+#define USED_BLOCKS 56
+#define WRITES 20000
+
+//deterministic random numbers, so that runs are comparable
+static uint32_t rngState;
+static uint32_t rng() {
+	rngState = rngState * 1664525UL + 1013904223UL;
+	return rngState >> 8;
+}
+
+//zipf distribution over n items with exponent s: item 0 is the most frequent
+class Zipf {
+public:
+	Zipf(int _n, double s):n(_n) {
+		cdf = (double*)malloc(n * sizeof(double));
+		double sum = 0;
+		for(int i=0; i<n; i++) {
+			sum += 1.0 / pow(i + 1, s);
+			cdf[i] = sum;
+		}
+		for(int i=0; i<n; i++) cdf[i] /= sum;
+	}
+	~Zipf() { free(cdf); }
+	int next() {
+		double u = (rng() & 0xffffff) / (double)0x1000000;
+		int i = 0;
+		while(i < n - 1 && cdf[i] < u) i++;
+		return i;
+	}
+private:
+	int n;
+	double* cdf;
+};
+
+static long totalErases(DummyFlash& flash) {
+	long total = 0;
+	for(int i=0; i<BLOCKS; i++) total += flash.getEraseCount(i);
+	return total;
+}
+
+static void printWear(const char* name, DummyFlash& flash, int writes) {
+	long total = totalErases(flash);
+	int minErase = 1 << 30, maxErase = 0;
+	for(int i=0; i<BLOCKS; i++) {
+		int e = flash.getEraseCount(i);
+		if(e < minErase) minErase = e;
+		if(e > maxErase) maxErase = e;
+	}
+	double mean = (double)total / BLOCKS, var = 0;
+	for(int i=0; i<BLOCKS; i++) {
+		double d = flash.getEraseCount(i) - mean;
+		var += d * d;
+	}
+	printf("%-22s erases %6li (%.3f per write)  min %5i  max %5i  stddev %7.1f\n",
+			name, total, (double)total / writes, minErase, maxErase, sqrt(var / BLOCKS));
+}
+
+//zipfian small writes, each one committed with a flush. With maintenance the application is idle every 100 writes
+static void benchZipf(const char* name, bool hotCold, int writes, bool maintenance=false) {
+	DummyFlash flash(BLOCKS);
+	FlashWearLeveler<DummyFlash, BLOCKS, false, true>* leveler = new FlashWearLeveler<DummyFlash, BLOCKS, false, true>(flash);
+	leveler->setHotColdSeparation(hotCold);
+	leveler->format();
+
+	rngState = 1;
+	uint8_t record[16];
+	//fill the used part of the virtual address space once
+	for(int b=0; b<USED_BLOCKS; b++) {
+		memset(record, b, sizeof(record));
+		leveler->writeBytes((long)b * 4094, record, sizeof(record));
+	}
+	leveler->flush();
+
+	Zipf zipf(USED_BLOCKS, 1.1);
+	for(int i=0; i<writes; i++) {
+		int b = zipf.next();
+		memset(record, i, sizeof(record));
+		leveler->writeBytes((long)b * 4094 + (rng() % 4000), record, sizeof(record));
+		leveler->flush();
+		if(maintenance && i % 100 == 99) {
+			leveler->maintenance(100000);
+		}
+	}
+	printWear(name, flash, writes);
+	delete leveler;
+}
+
+//telemetry records appended to a log, each one committed with a flush
+static void benchTelemetry(const char* name, bool compression) {
+	DummyFlash flash(BLOCKS);
+	FlashWearLeveler<DummyFlash, BLOCKS, true, true>* leveler = new FlashWearLeveler<DummyFlash, BLOCKS, true, true>(flash);
+	leveler->setCompression(compression);
+	leveler->format();
+	leveler->resetStats();
+
+	rngState = 1;
+	char record[64];
+	long addr = 0;
+	long size = (long)USED_BLOCKS * 4094;
+	clock_t start = clock();
+	for(int i=0; i<WRITES; i++) {
+		int len = snprintf(record, sizeof(record), "t=%08i temp=%3i.%i hum=%2i state=ok\n",
+				i * 10, 20 + (int)(rng() % 3), (int)(rng() % 10), 40 + (int)(rng() % 5));
+		if(addr + len > size) addr = 0;
+		leveler->writeBytes(addr, record, len);
+		leveler->flush();
+		addr += len;
+	}
+	double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+	const FlashWearLevelerStats& stats = leveler->getStats();
+	printf("%-22s flushes %6u  programmed %9u bytes (%6.1f per flush)  ratio %.2f  %.2fs\n",
+			name, stats.flushes, stats.bytesProgrammed, (double)stats.bytesProgrammed / stats.flushes,
+			stats.compressedBytes ? (double)stats.uncompressedBytes / stats.compressedBytes : 1.0, seconds);
+	printWear(name, flash, WRITES);
+	delete leveler;
+}
+
+//format of a blank chip and of one with written blocks after a reboot, a chip erase would erase all blocks
+static void benchFormat(int written) {
+	DummyFlash flash(BLOCKS);
+	FlashWearLeveler<DummyFlash, BLOCKS>* leveler = new FlashWearLeveler<DummyFlash, BLOCKS>(flash);
+	long erases = totalErases(flash);
+	leveler->format();
+	long blank = totalErases(flash) - erases;
+
+	rngState = 1;
+	uint8_t record[16];
+	for(int b=0; b<written; b++) {
+		memset(record, b, sizeof(record));
+		leveler->writeBytes((long)b * 4094 + (rng() % 4000), record, sizeof(record));
+		leveler->flush();
+	}
+	delete leveler;
+
+	leveler = new FlashWearLeveler<DummyFlash, BLOCKS>(flash);
+	leveler->initialize();
+	erases = totalErases(flash);
+	leveler->format();
+	printf("%2i blocks written      format erases %3li blank chip  %3li provisioned  (chip erase %i)\n",
+			written, blank, totalErases(flash) - erases, BLOCKS);
+	delete leveler;
+}
+
+//the CRC32 without tables, one bit per step, as a reference
+static uint32_t crc32Bitwise(uint32_t crc, const uint8_t* p, long len) {
+	crc = ~crc;
+	while(len-- > 0) {
+		crc ^= *p++;
+		for(int k=0; k<8; k++) crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320UL : crc >> 1;
+	}
+	return ~crc;
+}
+
+//cost of the block checksums (FWL_BLOCK_CRC) per MB of flushed or verified blocks
+static void benchChecksum() {
+	const long size = 1L << 20;
+	uint8_t* data = (uint8_t*)malloc(size);
+	rngState = 1;
+	for(long i=0; i<size; i++) data[i] = rng();
+
+	int rounds = 64;
+	uint32_t crc = 0;
+	clock_t start = clock();
+	for(int r=0; r<rounds; r++) {
+		for(long addr=0; addr<size; addr+=4096) crc = flashcrc32(crc, data + addr, 4096);
+	}
+	double sliced = (double)(clock() - start) / CLOCKS_PER_SEC / rounds;
+	start = clock();
+	uint32_t reference = crc32Bitwise(0, data, size);
+	double bitwise = (double)(clock() - start) / CLOCKS_PER_SEC;
+	if(reference != flashcrc32(0, data, size)) printf("crc32 mismatch!\n");
+	printf("%-22s %8.0f us per MB  (%6.1f MB/s, %5.1f us per 4k block)\n", "slicing-by-8", sliced * 1e6, 1 / sliced, sliced * 1e6 / 256);
+	printf("%-22s %8.0f us per MB  (%6.1f MB/s, %5.1f us per 4k block)\n", "bitwise", bitwise * 1e6, 1 / bitwise, bitwise * 1e6 / 256);
+	free(data);
+}
+
+int main(int argc, const char** argv) {
+	printf("zipf (s=1.1) writes to %i of %i blocks, %i writes\n", USED_BLOCKS, BLOCKS, WRITES);
+	benchZipf("next free block", false, WRITES);
+	benchZipf("hot/cold separation", true, WRITES);
+	printf("static wear leveling, maintenance(100ms) every 100 writes, %i writes\n", WRITES * 5);
+	benchZipf("next free block", false, WRITES * 5);
+	benchZipf("+ maintenance", false, WRITES * 5, true);
+	benchZipf("hot/cold separation", true, WRITES * 5);
+	benchZipf("+ maintenance", true, WRITES * 5, true);
+	printf("telemetry records appended to %i of %i blocks, %i writes\n", USED_BLOCKS, BLOCKS, WRITES);
+	benchTelemetry("uncompressed", false);
+	benchTelemetry("compressed", true);
+	printf("format\n");
+	benchFormat(4);
+	benchFormat(16);
+	benchFormat(USED_BLOCKS);
+	printf("crc32 block checksums\n");
+	benchChecksum();
+	return 0;
+}
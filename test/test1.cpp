@@ -1,8 +1,16 @@
 #include "../DummyFlash.h"
 #include "../FlashWearLeveler.h"
+#include "../FlashFS.h"
+#include "../FlashTrace.h"
+#include "../FlashPartition.h"
+#include "../FlashCRC.h"
 #include "stdio.h"
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+//size of a virtual block, 4096 minus the block header and the checksum trailer
+static const int VBLOCK = 4096 - (int)sizeof(fwl_block_t) - FWL_TRAILER_SIZE;
 
 DummyFlash flash(8);
 FlashWearLeveler<DummyFlash, 8> leveler(flash);
@@ -43,7 +51,6 @@ void writeString(long addr, const char* str) {
 
 void testAlternatingWrites() {
 	leveler.format();
-	uint8_t x=0;
 	for(int i=0;i<1000;i++) {
 		writeString(1, t1);
 		writeString(4000, t2);
@@ -79,7 +86,874 @@ void testSimpleWrite() {
 	flash.printWearLevel();
 }
 
-int main(int argc, const char** argv) {
+void verifyErased(long addr, long len) {
+	uint8_t* d = (uint8_t*)malloc(len);
+	leveler.readBytes(addr, d, len);
+	for(long i=0; i<len; i++) {
+		if(d[i] != 0xff) {
+			printf("discarded byte at %li is 0x%02x. failed!\n", addr + i, d[i]);
+			exit(1);
+		}
+	}
+	free(d);
+}
+
+void testDiscard() {
+	leveler.format();
+	writeString(10, t1);
+	writeString(4100, t2);
+	writeString(8200, t3);
+	leveler.flush();
+
+	//discard the whole second block
+	leveler.discard(VBLOCK, VBLOCK);
+	verifyErased(VBLOCK, VBLOCK);
+	verifyString(10, t1);
+	verifyString(8200, t3);
+
+	//discard while the block is active and dirty
+	writeString(4100, t2);
+	leveler.discard(VBLOCK, VBLOCK);
+	if(leveler.flushNeeded()) {
+		printf("discarded block still dirty. failed!\n");
+		exit(1);
+	}
+	verifyErased(VBLOCK, VBLOCK);
+
+	//partial discard of the active block
+	writeString(20, t2);
+	leveler.discard(20, 5);
+	verifyErased(20, 5);
+	leveler.flush();
+
+	//partial discard of the clean active block, read back after another block evicted it
+	writeString(40, t3);
+	leveler.flush();
+	leveler.discard(40, 5);
+	writeString(8200, t3);
+	verifyErased(40, 5);
+	leveler.flush();
+
+	//partial discard of an inactive block: it reads as erased at once and its activation skips the range
+	leveler.discard(60, 2000);
+	verifyErased(60, 2000);
+	uint32_t bytesRead = leveler.getStats().bytesRead;
+	writeString(3000, t2);
+	if(leveler.getStats().bytesRead - bytesRead != 4096 - 2000) {
+		printf("activation read the discarded range. failed!\n");
+		exit(1);
+	}
+	verifyErased(60, 2000);
+	leveler.flush();
+
+	//the discard must survive a remount
+	leveler.initialize();
+	verifyErased(VBLOCK, VBLOCK);
+	verifyErased(20, 5);
+	verifyErased(40, 5);
+	verifyErased(60, 2000);
+	verifyString(3000, t2);
+	verifyString(8200, t3);
+
+	flash.printWearLevel();
+}
+
+void testPersistentImage() {
+	const char* imageFile = "/tmp/fwl_test1.img";
+	const char* wearFile = "/tmp/fwl_test1.img.wear";
+	unlink(imageFile);
+	unlink(wearFile);
+	int erases[8];
+	{
+		DummyFlash fileFlash(8, imageFile);
+		FlashWearLeveler<DummyFlash, 8> l(fileFlash);
+		l.format();
+		//enough rewrites to reuse released blocks, which erases them
+		for(int i=0; i<20; i++) {
+			const char* t = i % 2 ? t2 : t1;
+			l.writeBytes(4100, t, strlen(t)+1);
+			l.flush();
+		}
+		for(int b=0; b<8; b++) erases[b] = fileFlash.getEraseCount(b);
+	}
+	{
+		DummyFlash fileFlash(8, imageFile);
+		FlashWearLeveler<DummyFlash, 8> l(fileFlash);
+		l.initialize();
+		char d[64];
+		l.readBytes(4100, d, strlen(t2)+1);
+		if(strcmp(d, t2) != 0) {
+			printf("image didn't persist. failed!\n");
+			exit(1);
+		}
+		int total = 0;
+		for(int b=0; b<8; b++) {
+			total += erases[b];
+			if(fileFlash.getEraseCount(b) != erases[b]) {
+				printf("erase counter of block %i didn't persist. failed!\n", b);
+				exit(1);
+			}
+		}
+		if(total == 0) {
+			printf("no erases to persist. failed!\n");
+			exit(1);
+		}
+	}
+	//an image of another size is rejected instead of cut or padded
+	{
+		DummyFlash fileFlash(16, imageFile);
+		if(fileFlash.isValid()) {
+			printf("image of the wrong size mapped. failed!\n");
+			exit(1);
+		}
+	}
+	unlink(imageFile);
+	unlink(wearFile);
+}
+
+static long totalErases() {
+	long total = 0;
+	for(int i=0; i<8; i++) total += flash.getEraseCount(i);
+	return total;
+}
+
+void verifyFile(FlashFS& fs, const char* name, const uint8_t* expected, long len) {
+	int fd = fs.open(name);
+	uint8_t* d = (uint8_t*)malloc(len + 1);
+	if(fd < 0 || fs.size(fd) != len || fs.read(fd, 0, d, len + 1) != len || memcmp(d, expected, len) != 0) {
+		printf("file %s doesn't match. failed!\n", name);
+		exit(1);
+	}
+	free(d);
+}
+
+void testFileSystem() {
+	static uint8_t a[VBLOCK * 5], b[100];
+	for(int i=0; i<(int)sizeof(a); i++) a[i] = i * 3;
+	for(int i=0; i<(int)sizeof(b); i++) b[i] = 200 - i;
+
+	leveler.format();
+	FlashFS fs(leveler);
+	if(fs.mount()) {
+		printf("mounted unformatted fs. failed!\n");
+		exit(1);
+	}
+	fs.format();
+
+	int fa = fs.create("a");
+	fs.append(fa, a, 5000);
+	int fb = fs.create("b");
+	fs.append(fb, b, sizeof(b));
+	//b sits behind a, so a needs a second extent
+	fs.append(fa, a + 5000, 4000);
+	fs.sync();
+	verifyFile(fs, "a", a, 9000);
+	verifyFile(fs, "b", b, sizeof(b));
+
+	//small appends only flush data blocks, the directory is written once by sync
+	long erases = totalErases();
+	for(int i=0; i<10; i++) {
+		fs.append(fb, b, 10);
+	}
+	fs.sync();
+	if(totalErases() - erases > 2) {
+		printf("%li erases for 10 appends. failed!\n", totalErases() - erases);
+		exit(1);
+	}
+
+	//remount
+	leveler.initialize();
+	FlashFS fs2(leveler);
+	if(!fs2.mount()) {
+		printf("mount failed!\n");
+		exit(1);
+	}
+	verifyFile(fs2, "a", a, 9000);
+	if(fs2.size(fs2.open("b")) != sizeof(b) + 100) {
+		printf("appends lost. failed!\n");
+		exit(1);
+	}
+
+	//the power goes off before the sync: the directory on flash still references the freed blocks
+	fs2.truncate(fs2.open("a"), 3000);
+	fs2.unlink("b");
+	leveler.flush();
+	leveler.initialize();
+	if(!fs2.mount()) {
+		printf("mount after power loss failed!\n");
+		exit(1);
+	}
+	verifyFile(fs2, "a", a, 9000);
+	if(fs2.size(fs2.open("b")) != sizeof(b) + 100) {
+		printf("unsynced unlink destroyed the file. failed!\n");
+		exit(1);
+	}
+
+	fs2.truncate(fs2.open("a"), 3000);
+	verifyFile(fs2, "a", a, 3000);
+	fs2.unlink("b");
+	if(fs2.open("b") >= 0) {
+		printf("unlink failed!\n");
+		exit(1);
+	}
+	//the freed blocks are reused
+	int fc = fs2.create("c");
+	if(fs2.append(fc, a, VBLOCK * 5) != VBLOCK * 5) {
+		printf("append into freed blocks failed!\n");
+		exit(1);
+	}
+	fs2.sync();
+	verifyFile(fs2, "c", a, VBLOCK * 5);
+	verifyFile(fs2, "a", a, 3000);
+	flashfs_entry_t before = *fs2.stat(fc);
+	if(fs2.append(fc, a, VBLOCK) >= 0) {
+		printf("append to full fs succeeded. failed!\n");
+		exit(1);
+	}
+	if(memcmp(&before, fs2.stat(fc), sizeof(before)) != 0) {
+		printf("failed append kept its blocks. failed!\n");
+		exit(1);
+	}
+	//appending behind a truncated partial block
+	fs2.truncate(fs2.open("a"), 2000);
+	fs2.append(fs2.open("a"), a + 2000, 500);
+	fs2.sync();
+	verifyFile(fs2, "a", a, 2500);
+}
+
+void verifyBytes(FlashWearLevelerBase& l, long addr, const uint8_t* expected, long len) {
+	static uint8_t d[VBLOCK * 2];
+	l.readBytes(addr, d, len);
+	if(memcmp(d, expected, len) != 0) {
+		printf("data at %li doesn't match. failed!\n", addr);
+		exit(1);
+	}
+}
+
+void testCompression() {
+	//virtual blocks 1 and 2
+	static uint8_t data[VBLOCK * 2];
+	uint8_t* text = data;
+	uint8_t* noise = data + VBLOCK;
+	for(int i=0; i<VBLOCK; i++) text[i] = t2[i % strlen(t2)];
+	srand(1);
+	for(int i=0; i<VBLOCK; i++) noise[i] = rand();
+
+	FlashWearLeveler<DummyFlash, 8, true> l(flash);
+	l.format();
+	l.writeBytes(VBLOCK, text, VBLOCK);
+	l.writeBytes(VBLOCK * 2, noise, VBLOCK);
+	l.flush();
+	const FlashWearLevelerStats& stats = l.getStats();
+	printf("compressed %u of %u bytes, %u bytes programmed\n", stats.compressedBytes, stats.uncompressedBytes, stats.bytesProgrammed);
+	if(stats.flushes != 2 || stats.compressedFlushes != 1 || stats.compressedBytes > 512) {
+		printf("text wasn't compressed or noise was. failed!\n");
+		exit(1);
+	}
+
+	//reading the compressed block decompresses it without activating it
+	verifyBytes(l, VBLOCK, text, VBLOCK);
+	//across the compressed and the plain block
+	verifyBytes(l, VBLOCK + 100, data + 100, VBLOCK);
+	if(l.readByte(VBLOCK + 7) != text[7]) {
+		printf("readByte from compressed block failed!\n");
+		exit(1);
+	}
+
+	//in a transaction the reads leave the dirty active block alone, nothing gets flushed or journaled
+	l.beginTransaction();
+	l.writeBytes(VBLOCK * 3, t1, strlen(t1));
+	uint32_t flushes = stats.flushes;
+	uint32_t erases = stats.erases;
+	verifyBytes(l, VBLOCK, text, VBLOCK);
+	if(l.readByte(VBLOCK + 9) != text[9] || stats.flushes != flushes || stats.erases != erases) {
+		printf("reading a compressed block flushed the active block. failed!\n");
+		exit(1);
+	}
+	l.commitTransaction();
+	verifyBytes(l, VBLOCK * 3, (const uint8_t*)t1, strlen(t1));
+
+	//modify the compressed block
+	l.writeBytes(VBLOCK + 10, t1, strlen(t1));
+	memcpy(text + 10, t1, strlen(t1));
+	l.flush();
+
+	FlashWearLeveler<DummyFlash, 8, true> l2(flash);
+	l2.initialize();
+	verifyBytes(l2, VBLOCK, text, VBLOCK);
+	verifyBytes(l2, VBLOCK * 2, noise, VBLOCK);
+
+	//without compression the block is written plain and stays readable
+	l2.setCompression(false);
+	l2.writeBytes(VBLOCK + 20, t3, strlen(t3));
+	memcpy(text + 20, t3, strlen(t3));
+	l2.flush();
+	if(l2.getStats().compressedFlushes != 0) {
+		printf("compressed with compression off. failed!\n");
+		exit(1);
+	}
+	l2.initialize();
+	verifyBytes(l2, VBLOCK, text, VBLOCK);
+}
+
+template<bool compressed>
+void testUnchangedWrites() {
+	FlashWearLeveler<DummyFlash, 8, compressed> l(flash);
+	l.format();
+	l.writeBytes(VBLOCK - 5, t2, strlen(t2));
+	l.flush();
+	long erases = totalErases();
+	uint32_t flushes = l.getStats().flushes;
+
+	//the same data again
+	l.writeBytes(VBLOCK - 5, t2, strlen(t2));
+	l.writeByte(VBLOCK + 3, t2[8]);
+	if(l.flushNeeded()) {
+		printf("unchanged write made the block dirty. failed!\n");
+		exit(1);
+	}
+
+	//changed and changed back
+	l.writeByte(VBLOCK + 3, 'x');
+	l.writeByte(VBLOCK + 3, t2[8]);
+	l.flush();
+	if(l.getStats().skippedFlushes != 1 || l.getStats().flushes != flushes || totalErases() != erases) {
+		printf("no-op flush wasn't skipped. failed!\n");
+		exit(1);
+	}
+
+	l.writeByte(VBLOCK + 3, 'x');
+	l.flush();
+	if(l.getStats().flushes != flushes + 1 || l.readByte(VBLOCK + 3) != 'x') {
+		printf("changed block wasn't flushed. failed!\n");
+		exit(1);
+	}
+}
+
+//drops all flash operations after a budget of writes and erases, like a power loss
+class PowerLossLeveler: public FlashWearLeveler<DummyFlash, 8> {
+public:
+	PowerLossLeveler(DummyFlash& f, int _budget): FlashWearLeveler<DummyFlash, 8>(f), budget(_budget) {}
+	int budget;
+protected:
+	virtual int flashWriteBytes(long addr, const void* buf, int len) {
+		if(budget-- <= 0) return 0;
+		return FlashWearLeveler<DummyFlash, 8>::flashWriteBytes(addr, buf, len);
+	}
+	virtual int flashBlockErase4K(long address) {
+		if(budget-- <= 0) return 0;
+		return FlashWearLeveler<DummyFlash, 8>::flashBlockErase4K(address);
+	}
+};
+
+//writes the string at the start of the virtual blocks 0, 2 and 3
+static void writeTxData(FlashWearLevelerBase& l, const char* str) {
+	l.writeBytes(0, str, strlen(str)+1);
+	l.writeBytes(VBLOCK * 2, str, strlen(str)+1);
+	l.writeBytes(VBLOCK * 3, str, strlen(str)+1);
+}
+
+static bool hasTxData(FlashWearLevelerBase& l, const char* str) {
+	char d[64];
+	for(int b=0; b<4; b+=(b ? 1 : 2)) {
+		l.readBytes(VBLOCK * b, d, strlen(str)+1);
+		if(strcmp(d, str) != 0) return false;
+	}
+	return true;
+}
+
+void testTransaction() {
+	leveler.format();
+	writeTxData(leveler, t1);
+	leveler.flush();
+
+	leveler.beginTransaction();
+	writeTxData(leveler, t2);
+	if(!hasTxData(leveler, t2)) {
+		printf("transaction doesn't read its own writes. failed!\n");
+		exit(1);
+	}
+	leveler.commitTransaction();
+	leveler.initialize();
+	if(!hasTxData(leveler, t2)) {
+		printf("committed transaction lost. failed!\n");
+		exit(1);
+	}
+
+	leveler.beginTransaction();
+	writeTxData(leveler, t3);
+	leveler.abortTransaction();
+	if(!hasTxData(leveler, t2)) {
+		printf("aborted transaction visible. failed!\n");
+		exit(1);
+	}
+	leveler.initialize();
+	if(!hasTxData(leveler, t2)) {
+		printf("aborted transaction visible after mount. failed!\n");
+		exit(1);
+	}
+
+	//group commit: the deferred transactions share the journal and the cached block
+	long erases = totalErases();
+	for(int i=0; i<10; i++) {
+		leveler.beginTransaction();
+		leveler.writeByte(100 + i, i);
+		leveler.commitTransaction(false);
+	}
+	leveler.abortTransaction();
+	if(leveler.readByte(100) != 0xff || totalErases() != erases) {
+		printf("aborted group visible. failed!\n");
+		exit(1);
+	}
+	for(int i=0; i<10; i++) {
+		leveler.beginTransaction();
+		leveler.writeByte(100 + i, i);
+		leveler.commitTransaction(i == 9);
+	}
+	//the new block and the journal get written, the old block and the journal erased
+	if(totalErases() - erases != 2) {
+		printf("%li erases for a group commit. failed!\n", totalErases() - erases);
+		exit(1);
+	}
+	leveler.initialize();
+	if(leveler.readByte(109) != 9 || !hasTxData(leveler, t2)) {
+		printf("group commit lost. failed!\n");
+		exit(1);
+	}
+
+	//a power loss at any point leaves either the old or the new data
+	bool sawOld = false, sawNew = false;
+	for(int budget=0; ; budget++) {
+		leveler.format();
+		writeTxData(leveler, t1);
+		leveler.flush();
+		PowerLossLeveler l(flash, budget);
+		l.initialize();
+		l.beginTransaction();
+		writeTxData(l, t2);
+		l.commitTransaction();
+
+		leveler.initialize();
+		bool isOld = hasTxData(leveler, t1), isNew = hasTxData(leveler, t2);
+		if(!isOld && !isNew) {
+			printf("power loss after %i operations broke the transaction. failed!\n", budget);
+			exit(1);
+		}
+		sawOld |= isOld;
+		sawNew |= isNew;
+		//the data has to survive another transaction
+		leveler.beginTransaction();
+		writeTxData(leveler, t3);
+		leveler.commitTransaction();
+		leveler.initialize();
+		if(!hasTxData(leveler, t3)) {
+			printf("transaction after recovery failed!\n");
+			exit(1);
+		}
+		if(l.budget > 0) break;
+	}
+	if(!sawOld || !sawNew) {
+		printf("power loss test didn't cover the commit. failed!\n");
+		exit(1);
+	}
+}
+
+template<bool compressed>
+void testSnapshot() {
+	FlashWearLeveler<DummyFlash, 8, compressed> l(flash);
+	fwl_block_t snapshot[8];
+	l.format();
+	writeTxData(l, t1);
+	l.flush();
+
+	long erases = totalErases();
+	l.takeSnapshot(snapshot);
+	if(totalErases() != erases || l.takeSnapshot(snapshot)) {
+		printf("snapshot isn't free or a second one was taken. failed!\n");
+		exit(1);
+	}
+	writeTxData(l, t2);
+	l.discard(VBLOCK * 3, VBLOCK);
+	l.flush();
+	//the old blocks are kept
+	if(totalErases() != erases) {
+		printf("snapshot blocks got erased. failed!\n");
+		exit(1);
+	}
+	char d[64];
+	for(int b=0; b<4; b+=(b ? 1 : 2)) {
+		l.readSnapshot(VBLOCK * b, d, strlen(t1)+1);
+		if(strcmp(d, t1) != 0) {
+			printf("snapshot of block %i changed. failed!\n", b);
+			exit(1);
+		}
+	}
+	l.readBytes(VBLOCK * 3, d, 1);
+	if(l.readByte(0) != t2[0] || (uint8_t)d[0] != 0xff) {
+		printf("writes after the snapshot lost. failed!\n");
+		exit(1);
+	}
+
+	//a remount drops the snapshot and its blocks
+	l.initialize();
+	if(l.readByte(VBLOCK * 2) != t2[0] || l.readByte(VBLOCK * 3) != 0xff) {
+		printf("remount with snapshot failed!\n");
+		exit(1);
+	}
+
+	l.takeSnapshot(snapshot);
+	writeTxData(l, t3);
+	l.flush();
+	erases = totalErases();
+	l.releaseSnapshot();
+	//the released blocks are only erased, when they get reused
+	if(totalErases() != erases || !hasTxData(l, t3)) {
+		printf("released snapshot blocks were erased at once. failed!\n");
+		exit(1);
+	}
+	//all blocks are usable again
+	for(int i=0; i<20; i++) {
+		writeTxData(l, i & 1 ? t1 : t2);
+		l.flush();
+	}
+	l.initialize();
+	if(!hasTxData(l, t1)) {
+		printf("writes after snapshot release failed!\n");
+		exit(1);
+	}
+
+	//fill the device while a snapshot is held. Every referenced block keeps a free block for its rewrite
+	l.format();
+	writeTxData(l, t1);
+	l.flush();
+	if(!l.takeSnapshot(snapshot)) {
+		printf("snapshot with enough free blocks refused. failed!\n");
+		exit(1);
+	}
+	int filled = 0, refused = 0;
+	for(int b=1; b<7; b+=(b == 1 ? 3 : 1)) {
+		if(l.writeBytes(VBLOCK * b, t3, strlen(t3)+1) == 0) filled++;
+		else refused++;
+	}
+	if(filled != 1 || refused != 3 || !l.flush()) {
+		printf("writes into the reserved blocks: %i taken, %i refused. failed!\n", filled, refused);
+		exit(1);
+	}
+	writeTxData(l, t2);
+	if(!l.flush() || !hasTxData(l, t2) || l.readByte(VBLOCK) != t3[0]) {
+		printf("rewrites of the snapshot blocks failed!\n");
+		exit(1);
+	}
+	for(int b=0; b<4; b+=(b ? 1 : 2)) {
+		l.readSnapshot(VBLOCK * b, d, strlen(t1)+1);
+		if(strcmp(d, t1) != 0) {
+			printf("snapshot of the full device changed. failed!\n");
+			exit(1);
+		}
+	}
+	l.releaseSnapshot();
+	for(int b=4; b<7; b++) {
+		if(l.writeBytes(VBLOCK * b, t3, strlen(t3)+1) != 0) {
+			printf("write after the snapshot release failed!\n");
+			exit(1);
+		}
+	}
+	//7 blocks with data and one free block
+	if(!l.flush() || l.takeSnapshot(snapshot)) {
+		printf("snapshot without enough free blocks taken. failed!\n");
+		exit(1);
+	}
+}
+
+static int findEvent(FlashTraceEvent* events, int n, int from, uint16_t op) {
+	for(int i=from; i<n; i++) {
+		if(events[i].op == op) return i;
+	}
+	printf("no %s event after %i. failed!\n", flashTraceOpName(op), from);
+	exit(1);
+}
+
+void testChecksums() {
+	if(flashcrc32(0, "123456789", 9) != 0xCBF43926UL || flashcrc32(flashcrc32(0, "1234", 4), "56789", 5) != 0xCBF43926UL) {
+		printf("crc32 check value failed!\n");
+		exit(1);
+	}
+#ifdef FWL_BLOCK_CRC
+	DummyFlash crcFlash(8);
+	FlashWearLeveler<DummyFlash, 8, true> l(crcFlash);
+	l.format();
+	l.setVerification(true, true);
+	static uint8_t noise[VBLOCK];
+	for(int i=0; i<VBLOCK; i++) noise[i] = rand();
+	l.writeBytes(VBLOCK * 2, noise, VBLOCK);
+	l.writeBytes(VBLOCK * 3, t2, strlen(t2)+1);
+	l.writeBytes(0, t1, strlen(t1)+1);
+	l.flush();
+
+	//a flipped bit in an uncompressed and in a compressed block is found, when the block gets activated
+	crcFlash.writeByte(l.virtual2physicalAddr(VBLOCK * 2 + 100), noise[100] ^ 0xff);
+	long compressedData = l.virtual2physicalAddr(VBLOCK * 3) + 4;
+	crcFlash.writeByte(compressedData, crcFlash.readByte(compressedData) & 0x0f);
+	l.writeByte(VBLOCK * 2 + 5, 'x');
+	l.writeByte(VBLOCK * 3 + 100, 'x');
+	if(l.getStats().checksumErrors != 2) {
+		printf("corrupted blocks not detected (%u). failed!\n", l.getStats().checksumErrors);
+		exit(1);
+	}
+	l.flush();
+
+	//the power went off, while block 0 was written again: the torn copy is dropped at mount
+	long torn = -1;
+	uint8_t d[4096];
+	for(int p=0; p<8 && torn < 0; p++) {
+		crcFlash.readBytes(p * 4096L, d, sizeof(d));
+		int i = 0;
+		while(i < 4096 && d[i] == 0xff) i++;
+		if(i == 4096) torn = p * 4096L;
+	}
+	crcFlash.readBytes(l.virtual2physicalAddr(0) - sizeof(fwl_block_t), d, sizeof(fwl_block_t) + strlen(t1));
+	d[sizeof(fwl_block_t) + 1] = 'X';
+	crcFlash.writeBytes(torn, d, sizeof(fwl_block_t) + strlen(t1));
+	uint32_t errors = l.getStats().checksumErrors;
+	l.initialize();
+	char c[64];
+	l.readBytes(0, c, strlen(t1)+1);
+	fwl_block_t header;
+	crcFlash.readBytes(torn, &header, sizeof(header));
+	if(strcmp(c, t1) != 0 || l.getStats().checksumErrors != errors + 1 || (header >> (sizeof(header)*8 - 1)) != 0) {
+		printf("torn block not dropped at mount. failed!\n");
+		exit(1);
+	}
+	verifyBytes(l, VBLOCK * 2 + 200, noise + 200, 100);
+#endif
+}
+
+void testTrace() {
+	FlashTraceEvent events[FWL_TRACE_SIZE];
+	flashTraceClear();
+	leveler.format();
+	leveler.writeBytes(VBLOCK + 10, t2, strlen(t2));
+	leveler.flush();
+	char d[64];
+	leveler.readBytes(VBLOCK + 10, d, strlen(t2));
+
+	int n = flashTraceRead(events, FWL_TRACE_SIZE);
+	int i = findEvent(events, n, 0, FT_FORMAT);
+	i = findEvent(events, n, i, FT_INIT);
+	if(events[i].block != 8) {
+		printf("init traced %i blocks. failed!\n", events[i].block);
+		exit(1);
+	}
+	i = findEvent(events, n, i, FT_WRITE);
+	if(events[i].addr != VBLOCK + 10 || events[i].len != strlen(t2)) {
+		printf("write traced wrong. failed!\n");
+		exit(1);
+	}
+	i = findEvent(events, n, i, FT_ACTIVATE);
+	i = findEvent(events, n, i, FT_FLUSH);
+	i = findEvent(events, n, i, FT_WRITE_BLOCK);
+	if(events[i].block != 1 || events[i].len != 4096) {
+		printf("block write traced wrong. failed!\n");
+		exit(1);
+	}
+	findEvent(events, n, i, FT_READ);
+	if(flashTraceRead(events, FWL_TRACE_SIZE) != 0 || flashTraceLost() != 0) {
+		printf("events read twice. failed!\n");
+		exit(1);
+	}
+
+	//the flush caused by activating another block isn't an api call
+	leveler.writeBytes(10, t1, strlen(t1));
+	leveler.writeBytes(VBLOCK * 2 + 10, t1, strlen(t1));
+	leveler.flush();
+	n = flashTraceRead(events, FWL_TRACE_SIZE);
+	int flushes = 0;
+	for(int j=0; j<n; j++) {
+		if(events[j].op == FT_FLUSH) flushes++;
+	}
+	if(flushes != 1 || leveler.getStats().flushes < 2) {
+		printf("internal flushes traced as api flushes. failed!\n");
+		exit(1);
+	}
+
+	//block ids of chips with more than 65536 blocks aren't cut
+	flashTrace(FT_ACTIVATE, 70000, 0, 0);
+	if(flashTraceRead(events, FWL_TRACE_SIZE) != 1 || events[0].block != 70000) {
+		printf("wide block id traced wrong. failed!\n");
+		exit(1);
+	}
+
+	//the ring buffer keeps the newest events
+	for(int j=0; j<FWL_TRACE_SIZE + 10; j++) {
+		leveler.readByte(j);
+	}
+	if(flashTraceLost() != 10 || flashTraceRead(events, FWL_TRACE_SIZE) != FWL_TRACE_SIZE || events[0].addr != 10) {
+		printf("ring buffer overflow failed!\n");
+		exit(1);
+	}
+}
+
+//a chip without SFDP data, SPIFlash reports its capacity as 0
+class UnknownSizeFlash : public DummyFlash {
+public:
+	UnknownSizeFlash(int blockCount) : DummyFlash(blockCount) {}
+	long getCapacity() { return 0; }
+};
+
+void testPartitions() {
+	DummyFlash partFlash(1 + 4 + 16);
+	FlashPartitionTable table;
+	if(table.read(partFlash)) {
+		printf("partition table on an erased chip. failed!\n");
+		exit(1);
+	}
+	table.add("config", 4);
+	table.add("log", 16);
+	if(table.add("log", 1) != 0 || !table.write(partFlash)) {
+		printf("partition table setup failed!\n");
+		exit(1);
+	}
+
+	FlashPartitionTable table2;
+	if(!table2.read(partFlash) || table2.getCount() != 2 || table2.find("log")->firstBlock != 5
+			|| table2.find("log")->blockCount != 16 || table2.getBlockCount() != 21) {
+		printf("partition table didn't persist. failed!\n");
+		exit(1);
+	}
+	FlashWearLeveler<DummyFlash, 4> config(partFlash, table2.find("config")->firstBlock);
+	FlashWearLeveler<DummyFlash, 16> log(partFlash, table2.find("log")->firstBlock);
+	config.format();
+	log.format();
+	config.writeBytes(10, t1, strlen(t1)+1);
+	config.flush();
+
+	//the hot log only wears its own blocks
+	int configErases[5];
+	for(int b=0; b<5; b++) configErases[b] = partFlash.getEraseCount(b);
+	for(int i=0; i<200; i++) {
+		log.writeBytes((long)(i % 15) * VBLOCK + i, t2, strlen(t2)+1);
+		log.flush();
+	}
+	for(int b=0; b<5; b++) {
+		if(partFlash.getEraseCount(b) != configErases[b]) {
+			printf("log partition erased block %i. failed!\n", b);
+			exit(1);
+		}
+	}
+	if(!table.read(partFlash)) {
+		printf("partition table got overwritten. failed!\n");
+		exit(1);
+	}
+
+	//formatting one partition keeps the other
+	log.format();
+	config.initialize();
+	char d[64];
+	config.readBytes(10, d, strlen(t1)+1);
+	if(strcmp(d, t1) != 0) {
+		printf("config partition lost its data. failed!\n");
+		exit(1);
+	}
+	if(log.getStats().flushes != 200 || config.getStats().flushes != 1 || log.getStats().bytesRead == 0) {
+		printf("per partition stats failed!\n");
+		exit(1);
+	}
+	//the size of a flash without a capacity isn't checked
+	UnknownSizeFlash unknownFlash(1 + 4);
+	FlashPartitionTable table3;
+	table3.add("config", 4);
+	if(!table3.write(unknownFlash) || !table2.read(unknownFlash) || table2.getCount() != 1) {
+		printf("partition table on a flash of unknown size failed!\n");
+		exit(1);
+	}
+	table3.add("log", 17);
+	if(table3.write(partFlash)) {
+		printf("partition table too big for the flash. failed!\n");
+		exit(1);
+	}
+
+	printf("partitions: config %u flushes %u bytes read, log %u flushes %u erases %u bytes read\n",
+			config.getStats().flushes, config.getStats().bytesRead,
+			log.getStats().flushes, log.getStats().erases, log.getStats().bytesRead);
+}
+
+#ifdef FWL_WIDE_HEADERS
+//more blocks than the 14 bit block ids of the narrow headers can address
+#define LARGE_BLOCKS 17000
+DummyFlash largeFlash(LARGE_BLOCKS);
+FlashWearLeveler<DummyFlash, LARGE_BLOCKS> largeLeveler(largeFlash);
+
+void testLargeChip() {
+	largeLeveler.format();
+	long top = (long)VBLOCK * (LARGE_BLOCKS - 2);
+	largeLeveler.writeBytes(top, t1, strlen(t1)+1);
+	largeLeveler.writeBytes((long)VBLOCK * 16384 + 10, t2, strlen(t2)+1);
+	largeLeveler.writeBytes(10, t3, strlen(t3)+1);
+	largeLeveler.flush();
+	//commits, aborts and the snapshot release find the unowned and held blocks in the bitmaps
+	long scratch = (long)VBLOCK * 16385;
+	fwl_block_t* snapshot = new fwl_block_t[LARGE_BLOCKS];
+	largeLeveler.takeSnapshot(snapshot);
+	largeLeveler.beginTransaction();
+	largeLeveler.writeBytes(scratch, t1, strlen(t1)+1);
+	largeLeveler.writeBytes(10, t2, strlen(t2)+1);
+	largeLeveler.abortTransaction();
+	largeLeveler.beginTransaction();
+	largeLeveler.writeBytes(scratch, t2, strlen(t2)+1);
+	if(!largeLeveler.commitTransaction()) {
+		printf("large chip: transaction failed!\n");
+		exit(1);
+	}
+	largeLeveler.releaseSnapshot();
+	delete[] snapshot;
+	//fill the chip until the allocator has to find the last free blocks
+	for(int i=0; i<LARGE_BLOCKS - 3; i++) {
+		largeLeveler.writeByte((long)VBLOCK * ((i * 7) % (LARGE_BLOCKS - 3)) + 100, i);
+	}
+	largeLeveler.flush();
+
+	largeLeveler.initialize();
+	char d[64];
+	largeLeveler.readBytes(top, d, strlen(t1)+1);
+	if(strcmp(d, t1) != 0) {
+		printf("large chip: last block failed!\n");
+		exit(1);
+	}
+	largeLeveler.readBytes((long)VBLOCK * 16384 + 10, d, strlen(t2)+1);
+	if(strcmp(d, t2) != 0) {
+		printf("large chip: block 16384 failed!\n");
+		exit(1);
+	}
+	largeLeveler.readBytes(10, d, strlen(t3)+1);
+	if(strcmp(d, t3) != 0) {
+		printf("large chip: block 0 failed!\n");
+		exit(1);
+	}
+	largeLeveler.readBytes(scratch, d, strlen(t2)+1);
+	if(strcmp(d, t2) != 0) {
+		printf("large chip: transaction block failed!\n");
+		exit(1);
+	}
+	printf("large chip: %i blocks, %li bytes\n", LARGE_BLOCKS, largeLeveler.getSize());
+}
+#endif
+
+int main() {
 	testSimpleWrite();
 	testAlternatingWrites();
+	testDiscard();
+	testPersistentImage();
+	testFileSystem();
+	testCompression();
+	testUnchangedWrites<false>();
+	testUnchangedWrites<true>();
+	testTransaction();
+	testSnapshot<false>();
+	testSnapshot<true>();
+	testPartitions();
+	testChecksums();
+	testTrace();
+#ifdef FWL_WIDE_HEADERS
+	testLargeChip();
+#endif
 }
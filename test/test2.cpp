@@ -0,0 +1,438 @@
+//runs SPIFlash and the wear leveler against the simulated chip in arduino/FlashSim
+#include <Arduino.h>
+#include <SPIFlash.h>
+#include "arduino/FlashSim.h"
+#include "../FlashWearLeveler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+FlashSim chip(64*4096L, 0xEF30);
+SPIFlash flash(8, 0xEF30);
+FlashWearLeveler<SPIFlash, 64, false, true> leveler(flash);
+
+const char* t1="Hallo Welt";
+const char* t2="The quick brown fox jumps over the lazy dog!";
+
+void check(bool ok, const char* what) {
+	if(!ok) {
+		printf("%s failed!\n", what);
+		exit(1);
+	}
+}
+
+void printBusStats(const char* name, unsigned long commands) {
+	printf("%s: %lu transactions, %lu status polls (a poll before each command would be at least %lu)\n",
+			name, chip.transactions, chip.statusReads, commands);
+}
+
+void testStatusTracking() {
+	check(flash.initialize(), "initialize");
+	flash.blockErase4K(0);
+	check(!flash.isIdle(), "busy after erase");
+	flash.writeBytes(100, t2, strlen(t2)+1);
+
+	//reads of an idle chip don't need any status polls
+	flash.waitIdle();
+	check(flash.isIdle(), "idle after waitIdle");
+	chip.resetCounters();
+	char buf[64];
+	for(int i=0; i<100; i++) {
+		flash.readBytes(100, buf, strlen(t2)+1);
+	}
+	check(strcmp(buf, t2) == 0, "read back");
+	check(chip.statusReads == 0, "no polls on idle reads");
+	printBusStats("100 idle reads", chip.transactions);
+
+	//a read right after a program polls until the program is done
+	chip.resetCounters();
+	flash.writeBytes(300, t1, strlen(t1)+1);
+	flash.readBytes(300, buf, strlen(t1)+1);
+	check(strcmp(buf, t1) == 0, "read after program");
+	check(chip.statusReads > 0, "poll after program");
+	check(chip.busyViolations == 0, "no commands while busy");
+}
+
+void testLeveler() {
+	chip.resetCounters();
+	leveler.format();
+	unsigned long commands = chip.transactions - chip.statusReads;
+	for(int i=0; i<20; i++) {
+		leveler.writeBytes(10, t1, strlen(t1)+1);
+		leveler.writeBytes(5000, t2, strlen(t2)+1);
+		leveler.flush();
+	}
+	char buf[64];
+	for(int i=0; i<200; i++) {
+		leveler.readBytes(10, buf, strlen(t1)+1);
+		leveler.readBytes(5000, buf, strlen(t2)+1);
+	}
+	check(strcmp(buf, t2) == 0, "leveler read back");
+	leveler.initialize();
+	leveler.readBytes(10, buf, strlen(t1)+1);
+	check(strcmp(buf, t1) == 0, "leveler read back after mount");
+	check(chip.busyViolations == 0, "no leveler commands while busy");
+	commands = chip.transactions - chip.statusReads;
+	printBusStats("leveler workload", commands);
+}
+
+//format only erases, what isn't erased yet
+void testFormat() {
+	//a blank chip gets blank checked instead of erased
+	FlashSim blankChip(64*4096L, 0xEF30);
+	SPIFlash blankFlash(8, 0xEF30);
+	FlashWearLeveler<SPIFlash, 64> blankLeveler(blankFlash);
+	check(blankFlash.initialize(), "blank initialize");
+	blankChip.memory[5*4096 + 100] = 0;
+	unsigned long start = simMicros;
+	check(blankLeveler.format(), "blank format");
+	unsigned long blank = simMicros - start;
+	check(blankChip.erases == 1 && blankChip.memory[5*4096 + 100] == 0xff, "blank check");
+	FlashSim::current = &chip;
+
+	//after a mount the erased blocks are known
+	leveler.initialize();
+	leveler.writeBytes(10, t1, strlen(t1)+1);
+	leveler.flush();
+	leveler.writeBytes(10, t2, strlen(t2)+1);
+	leveler.flush();
+	leveler.writeBytes(5000, t2, strlen(t2)+1);
+	leveler.flush();
+	flash.waitIdle();
+	chip.resetCounters();
+	start = simMicros;
+	check(leveler.format(), "format");
+	flash.waitIdle();
+	unsigned long mounted = simMicros - start;
+	printf("format: %lu us blank chip, %lu us with %lu dirty blocks, a chip erase takes %lu us\n",
+			blank, mounted, chip.erases, chip.chipEraseTime);
+	check(chip.erases > 0 && chip.erases <= 4, "format erases the dirty blocks");
+	check(mounted < chip.chipEraseTime && blank < chip.chipEraseTime, "format time");
+	char buf[64];
+	leveler.readBytes(10, buf, strlen(t1)+1);
+	check((uint8_t)buf[0] == 0xff, "formatted");
+	check(chip.busyViolations == 0, "no commands while busy");
+}
+
+//static wear leveling moves cold data within the time budget
+void testMaintenance() {
+	leveler.setHotColdSeparation(false);
+	leveler.format();
+	for(int b=1; b<48; b++) {
+		leveler.writeBytes((long)b * leveler.getBlockSize(), t1, strlen(t1)+1);
+	}
+	leveler.flush();
+	//one hot block wears the free blocks, while the cold blocks keep theirs
+	for(int i=0; i<400; i++) {
+		leveler.writeBytes(0, &i, sizeof(i));
+		leveler.flush();
+	}
+	flash.waitIdle();
+	chip.resetCounters();
+	unsigned long start = simMicros;
+	check(leveler.maintenance(1000) == 0, "no migration beyond the budget");
+	check(simMicros - start <= 1000, "small maintenance budget");
+
+	start = simMicros;
+	int migrated = leveler.maintenance(300000);
+	flash.waitIdle();
+	unsigned long elapsed = simMicros - start;
+	printf("maintenance: %i blocks migrated in %lu us of 300000 us\n", migrated, elapsed);
+	check(migrated > 0, "cold blocks migrated");
+	check(elapsed <= 300000, "maintenance budget");
+	check(chip.busyViolations == 0, "no maintenance commands while busy");
+	char buf[64];
+	for(int b=1; b<48; b++) {
+		leveler.readBytes((long)b * leveler.getBlockSize(), buf, strlen(t1)+1);
+		check(strcmp(buf, t1) == 0, "migrated block read back");
+	}
+	leveler.initialize();
+	leveler.readBytes(47 * leveler.getBlockSize(), buf, strlen(t1)+1);
+	check(strcmp(buf, t1) == 0, "migrated block read back after mount");
+	leveler.setHotColdSeparation(true);
+}
+
+//returns the simulated time a read takes, while a 4K erase is running
+unsigned long readLatencyDuringErase() {
+	char buf[64];
+	flash.waitIdle();
+	flash.blockErase4K(4096);
+	unsigned long start = simMicros;
+	flash.readBytes(100, buf, strlen(t2)+1);
+	unsigned long latency = simMicros - start;
+	check(strcmp(buf, t2) == 0, "read during erase");
+	return latency;
+}
+
+void testEraseSuspend() {
+	flash.waitIdle();
+	flash.blockErase4K(0);
+	flash.writeBytes(100, t2, strlen(t2)+1);
+
+	unsigned long blocking = readLatencyDuringErase();
+	flash.setEraseSuspend(true);
+	chip.resetCounters();
+	unsigned long suspended = readLatencyDuringErase();
+	check(chip.suspends == 1, "erase suspended");
+	printf("read latency during erase: %lu us blocking, %lu us with suspend\n", blocking, suspended);
+	check(suspended < 200, "suspended read latency");
+
+	//the erase continues after the read
+	check(!flash.isIdle(), "erase resumed");
+	flash.waitIdle();
+	check(chip.memory[4096] == 0xff && chip.memory[8191] == 0xff, "erase finished");
+	check(chip.busyViolations == 0, "no commands while busy");
+
+	//an erase, which finished unnoticed, isn't suspended and resumed
+	flash.blockErase4K(4096);
+	delayMicroseconds(chip.erase4KTime + 1000);
+	chip.resetCounters();
+	char buf[64];
+	flash.readBytes(100, buf, strlen(t2)+1);
+	check(chip.suspends == 0 && flash.isIdle(), "finished erase not suspended");
+
+	//reads through the leveler don't wait for the erase of the old block in flush()
+	leveler.format();
+	leveler.writeBytes(10, t1, strlen(t1)+1);
+	leveler.writeBytes(5000, t2, strlen(t2)+1);
+	leveler.flush();
+	leveler.writeBytes(10, t2, strlen(t2)+1);
+	leveler.flush();
+	leveler.writeBytes(10, t1, strlen(t1)+1);
+	leveler.flush();
+	unsigned long start = simMicros;
+	leveler.readBytes(5000, buf, strlen(t2)+1);
+	printf("leveler read after flush: %lu us\n", simMicros - start);
+	check(strcmp(buf, t2) == 0, "leveler read during erase");
+	check(simMicros - start < 1000, "leveler read latency");
+	check(chip.busyViolations == 0, "no leveler commands while busy");
+	flash.setEraseSuspend(false);
+}
+
+void testBoundedInterruptOff() {
+	static uint8_t pattern[4096], buf[4096];
+	for(int i=0; i<4096; i++) pattern[i] = i * 7;
+	flash.blockErase4K(8192);
+	flash.writeBytes(8192, pattern, 4096);
+	flash.waitIdle();
+
+	long capacity = flash.getCapacity();
+	flash.resetInterruptOffTime();
+	check(flash.getCapacity() == capacity, "reset keeps the detected parameters");
+	simMaxMaskedMicros = 0;
+	unsigned long start = simMicros;
+	flash.readBytes(8192, buf, 4096);
+	unsigned long unbounded = simMicros - start;
+	check(memcmp(buf, pattern, 4096) == 0, "unbounded read");
+	printf("4K read: %lu us, interrupts off for %lu us\n", unbounded, simMaxMaskedMicros);
+	check(flash.getMaxInterruptOffTime() == 0, "no timing without a limit");
+
+	flash.setMaxInterruptOffTime(100);
+	flash.resetInterruptOffTime();
+	simMaxMaskedMicros = 0;
+	memset(buf, 0, 4096);
+	start = simMicros;
+	flash.readBytes(8192, buf, 4096);
+	unsigned long bounded = simMicros - start;
+	check(memcmp(buf, pattern, 4096) == 0, "bounded read");
+	printf("4K read in bursts: %lu us, interrupts off for %lu us (driver reports %lu us)\n",
+			bounded, simMaxMaskedMicros, flash.getMaxInterruptOffTime());
+	check(simMaxMaskedMicros < 150, "bounded interrupt off time");
+	check(flash.getMaxInterruptOffTime() <= simMaxMaskedMicros, "reported interrupt off time");
+	flash.setMaxInterruptOffTime(0);
+}
+
+void testAutoSleep() {
+	char buf[64];
+	flash.waitIdle();
+	flash.blockErase4K(12288);
+	flash.setAutoSleep(1000);
+	chip.resetCounters();
+	//not while the erase is running
+	check(!flash.idle(), "no sleep while busy");
+	while(!flash.idle()) delayMicroseconds(100);
+	check(chip.sleeps == 1 && chip.memory[12288] == 0xff, "sleep after the erase");
+
+	//the next command wakes the chip up and waits for tRES1
+	flash.writeBytes(12288, t1, strlen(t1)+1);
+	flash.readBytes(12288, buf, strlen(t1)+1);
+	check(strcmp(buf, t1) == 0, "read after wake up");
+	check(chip.wakeups == 1 && flash.getWakeupCount() > 0, "woken up once");
+	check(chip.sleepViolations == 0, "no commands while asleep");
+	check(chip.busyViolations == 0, "no commands while busy");
+
+	//a main loop, which reads and writes now and then, idles in between and flushes every 30ms
+	//without batching the flush wakes the chip up again, after it went to sleep
+	leveler.format();
+	leveler.writeBytes(5000, t2, strlen(t2)+1);
+	leveler.flush();
+	//the reads of block 1 come from flash, not from the active block
+	leveler.writeBytes(10, t1, strlen(t1)+1);
+	leveler.flush();
+	leveler.resetStats();
+	for(int batching=0; batching<2; batching++) {
+		flash.sleep();
+		chip.resetCounters();
+		for(int i=0; i<10; i++) {
+			leveler.readBytes(5000, buf, strlen(t2)+1);
+			leveler.writeBytes(20 + i, t1, strlen(t1)+1);
+			for(int t=0; t<1000; t++) {
+				delayMicroseconds(100);
+				if(batching) {
+					leveler.idle();
+				} else {
+					flash.idle();
+				}
+				if(t % 300 == 299) leveler.flush();
+			}
+		}
+		printf("%s: %lu sleeps, %lu wake ups, %lu ms asleep\n", batching ? "leveler idle" : "flash idle",
+				chip.sleeps, chip.wakeups, chip.sleepTime / 1000);
+		check(chip.wakeups == (batching ? 10ul : 20ul), "wake ups");
+	}
+	check(leveler.getStats().flushesBeforeSleep == 10, "flushes before sleep");
+	check(!leveler.flushNeeded() && flash.isAsleep(), "flushed before sleep");
+	leveler.readBytes(29, buf, strlen(t1)+1);
+	check(strcmp(buf, t1) == 0, "leveler read after sleep");
+	check(chip.sleepViolations == 0, "no leveler commands while asleep");
+	check(chip.busyViolations == 0, "no leveler commands while busy");
+	flash.setAutoSleep(0);
+}
+
+struct VendorParams {
+	const char* name;
+	uint16_t jedecId;
+	long capacity;
+	int pageSize;       //0: JESD216 table without page size (dword 11)
+	uint8_t erase4KOpcode;
+	uint8_t read112Opcode, read122Opcode, read114Opcode, read144Opcode;
+};
+
+static void putDword(uint8_t* p, uint32_t v) {
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static int log2i(long v) {
+	int n = 0;
+	while((1L << n) < v) n++;
+	return n;
+}
+
+//builds a sfdp image with the basic flash parameter table at 0x30
+static int buildSFDP(const VendorParams& v, uint8_t* sfdp) {
+	int dwords = v.pageSize ? 16 : 9;
+	memset(sfdp, 0xff, 0x30 + dwords * 4);
+	memcpy(sfdp, "SFDP", 4);
+	sfdp[4] = v.pageSize ? 6 : 0;
+	sfdp[5] = 1;
+	sfdp[6] = 0;
+	uint8_t* ph = sfdp + 8;
+	ph[0] = 0; ph[1] = sfdp[4]; ph[2] = 1; ph[3] = dwords;
+	ph[4] = 0x30; ph[5] = 0; ph[6] = 0; ph[7] = 0xff;
+	uint8_t* t = sfdp + 0x30;
+	uint32_t dw1 = 0xff800000UL | 0x01 | (v.erase4KOpcode << 8);
+	if(v.read112Opcode) dw1 |= 1UL << 16;
+	if(v.read122Opcode) dw1 |= 1UL << 20;
+	if(v.read144Opcode) dw1 |= 1UL << 21;
+	if(v.read114Opcode) dw1 |= 1UL << 22;
+	//3 or 4 byte addresses
+	if(v.capacity > 0x1000000L) dw1 |= 1UL << 17;
+	putDword(t, dw1);
+	putDword(t + 4, v.capacity * 8 - 1);
+	//1-4-4: 4 dummy + 2 mode clocks, 1-1-4: 8 dummy clocks
+	putDword(t + 8, 0x44 | (v.read144Opcode << 8) | (0x08UL << 16) | ((uint32_t)v.read114Opcode << 24));
+	//1-1-2: 8 dummy clocks, 1-2-2: 4 dummy clocks
+	putDword(t + 12, 0x08 | (v.read112Opcode << 8) | (0x04UL << 16) | ((uint32_t)v.read122Opcode << 24));
+	putDword(t + 16, 0xfffffffe);
+	putDword(t + 20, 0xff000000);
+	putDword(t + 24, 0xff000000);
+	putDword(t + 28, 12 | (v.erase4KOpcode << 8) | (15UL << 16) | (0x52UL << 24));
+	putDword(t + 32, 16 | (0xd8 << 8));
+	if(v.pageSize) {
+		putDword(t + 36, 0);
+		putDword(t + 40, log2i(v.pageSize) << 4);
+	}
+	return 0x30 + dwords * 4;
+}
+
+void testSFDP() {
+	const VendorParams vendors[] = {
+		{ "winbond W25Q32", 0xEF40, 4L*1024*1024, 256, 0x20, 0x3B, 0xBB, 0x6B, 0xEB },
+		{ "winbond W25Q256", 0xEF40, 32L*1024*1024, 256, 0x20, 0x3B, 0xBB, 0x6B, 0xEB },
+		{ "macronix MX25L8006 (JESD216 rev 0)", 0xC220, 1024L*1024, 0, 0x20, 0x3B, 0, 0, 0 },
+		{ "64 byte pages, 0xD7 sector erase", 0x1F86, 512L*1024, 64, 0xD7, 0x3B, 0, 0, 0 },
+		{ "no sfdp", 0xBF8E, 0, 0, 0, 0, 0, 0, 0 },
+	};
+	static uint8_t pattern[600], buf[600];
+	for(int i=0; i<600; i++) pattern[i] = i * 13;
+
+	for(unsigned int n=0; n<sizeof(vendors)/sizeof(vendors[0]); n++) {
+		const VendorParams& v = vendors[n];
+		uint8_t sfdp[0x30 + 16*4];
+		FlashSim vendorChip(v.capacity ? v.capacity : 512L*1024, v.jedecId);
+		if(v.capacity) {
+			vendorChip.sfdpLen = buildSFDP(v, sfdp);
+			vendorChip.sfdp = sfdp;
+			vendorChip.pageSize = v.pageSize ? v.pageSize : 256;
+			vendorChip.erase4KOpcode = v.erase4KOpcode;
+		}
+		SPIFlash vendorFlash(8, v.jedecId);
+		check(vendorFlash.initialize(), "vendor initialize");
+		const SPIFlashParams& p = vendorFlash.getParams();
+		printf("%s: capacity %li, page %i, 4K erase 0x%02x, 1-1-2 0x%02x/%i, 1-2-2 0x%02x/%i, 1-1-4 0x%02x/%i, 1-4-4 0x%02x/%i\n",
+				v.name, p.capacity, p.pageSize, p.erase4KOpcode,
+				p.read112Opcode, p.read112Dummy, p.read122Opcode, p.read122Dummy,
+				p.read114Opcode, p.read114Dummy, p.read144Opcode, p.read144Dummy);
+		check(p.capacity == v.capacity, "sfdp capacity");
+		check(p.pageSize == (v.pageSize ? v.pageSize : 256), "sfdp page size");
+		check(p.erase4KOpcode == (v.capacity ? v.erase4KOpcode : 0x20), "sfdp 4K erase opcode");
+		check(p.read112Opcode == v.read112Opcode && p.read114Opcode == v.read114Opcode, "sfdp read opcodes");
+		check(p.read122Opcode == v.read122Opcode && p.read144Opcode == v.read144Opcode, "sfdp read opcodes");
+		check(!v.read144Opcode || p.read144Dummy == 6, "sfdp 1-4-4 dummy clocks");
+
+		//erase and program across page boundaries with the discovered parameters
+		vendorFlash.blockErase4K(4096);
+		vendorFlash.writeBytes(4096 + 30, pattern, sizeof(pattern));
+		vendorFlash.readBytes(4096 + 30, buf, sizeof(buf));
+		check(memcmp(buf, pattern, sizeof(pattern)) == 0, "program with sfdp page size");
+		check(vendorChip.busyViolations == 0, "no commands while busy");
+
+		//the upper half of a 32MB chip needs 4 byte addresses, a 3 byte address would wrap to the bottom
+		check(p.addressBytes == (v.capacity > 0x1000000L ? 4 : 3), "4 byte address mode");
+		if(v.capacity > 0x1000000L) {
+			long top = v.capacity - 4096;
+			vendorFlash.blockErase4K(top);
+			vendorFlash.writeBytes(top + 30, pattern, sizeof(pattern));
+			check(memcmp(vendorChip.memory + top + 30, pattern, sizeof(pattern)) == 0, "program above 16MB");
+			check(memcmp(vendorChip.memory + (top & 0xffffff) + 30, pattern, sizeof(pattern)) != 0, "no wrap at 16MB");
+			vendorFlash.readBytes(top + 30, buf, sizeof(buf));
+			check(memcmp(buf, pattern, sizeof(pattern)) == 0, "read above 16MB");
+			check(vendorFlash.readByte(top + 31) == pattern[1], "read byte above 16MB");
+		}
+	}
+	FlashSim::current = &chip;
+
+	//the leveler refuses flash that is too small
+	FlashSim smallChip(32*4096L, 0xEF40);
+	uint8_t sfdp[0x30 + 16*4];
+	VendorParams small = { "small", 0xEF40, 32*4096L, 256, 0x20, 0, 0, 0, 0 };
+	smallChip.sfdpLen = buildSFDP(small, sfdp);
+	smallChip.sfdp = sfdp;
+	SPIFlash smallFlash(8, 0xEF40);
+	FlashWearLeveler<SPIFlash, 64> smallLeveler(smallFlash);
+	check(smallFlash.initialize(), "small initialize");
+	check(!smallLeveler.initialize(), "leveler size check");
+	FlashSim::current = &chip;
+}
+
+int main(int argc, const char** argv) {
+	testStatusTracking();
+	testLeveler();
+	testFormat();
+	testMaintenance();
+	testEraseSuspend();
+	testBoundedInterruptOff();
+	testAutoSleep();
+	testSFDP();
+	printf("all passed\n");
+}
@@ -0,0 +1,37 @@
+#ifndef _HOSTLEVELER_H_
+#define _HOSTLEVELER_H_
+
+#include "../DummyFlash.h"
+#include "../FlashWearLeveler.h"
+
+//leveler with the caches on the heap, for block counts only known at runtime
+class HostLeveler: public FlashWearLevelerBase {
+public:
+	HostLeveler(DummyFlash& _flash, int blocks, bool compression):
+		FlashWearLevelerBase(blocks, new fwl_block_t[blocks], new fwl_block_t[blocks], new uint8_t[blocks],
+				new uint16_t[blocks], new uint16_t[blocks], compression ? new uint8_t[4096] : 0,
+				new uint32_t[FWL_FREE_MAP_WORDS(blocks)]), flash(_flash) {}
+	~HostLeveler() {
+		delete[] blockMap;
+		delete[] blockHeaderCache;
+		delete[] blockHeat;
+		delete[] blockLastFlush;
+		delete[] eraseCount;
+		delete[] compressBuffer;
+		delete[] freeMap;
+	}
+protected:
+	virtual uint8_t flashReadByte(long addr) { stats.bytesRead++; return flash.readByte(addr); }
+	virtual int flashReadBytes(long addr, void* buf, long len) { stats.bytesRead += len; flash.readBytes(addr, buf, len); return 0; }
+	virtual int flashWriteByte(long addr, uint8_t byt) { flash.writeByte(addr, byt); return 0; }
+	virtual int flashWriteBytes(long addr, const void* buf, int len) { flash.writeBytes(addr, buf, len); return 0; }
+	virtual int flashChipErase() { flash.chipErase(); return 0; }
+	virtual int flashBlockErase4K(long address) { flash.blockErase4K(address); return 0; }
+	virtual long flashSize() { return flash.getCapacity(); }
+	virtual bool flashSleepDue() { return flash.sleepDue(); }
+	virtual void flashSleep() { flash.sleep(); }
+
+	DummyFlash& flash;
+};
+
+#endif
@@ -0,0 +1,358 @@
+//builds, dumps and verifies flash images with a FlashFS on top of the wear leveler
+//a built image is programmed raw from address 0, the device mounts it without erasing or writing anything
+#include "../DummyFlash.h"
+#include "../FlashWearLeveler.h"
+#include "../FlashFS.h"
+#include "HostLeveler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//block header bits, see FlashWearLeveler.cpp. The tool has to be built with the same FWL_WIDE_HEADERS as the device
+#define HEADER_ERASED ((fwl_block_t)~(fwl_block_t)0)
+#define HEADER_NOT_DELETED ((fwl_block_t)(HEADER_ERASED ^ (HEADER_ERASED >> 1)))
+#define HEADER_COMPRESSED (HEADER_NOT_DELETED >> 1)
+#define HEADER_ID_MASK (HEADER_COMPRESSED - 1)
+#define HEADER_JOURNAL (HEADER_NOT_DELETED | (HEADER_ID_MASK - 1))
+#define HEADER_ID(v) ((unsigned)((v) & HEADER_ID_MASK))
+
+static void usage(const char* name) {
+	printf("usage: %s build [-c] -b blocks <image> <file>...\n", name);
+	printf("       %s dump [-c] [-b blocks] <image>\n", name);
+	printf("       %s verify [-c] [-b blocks] <image> [<file>...]\n", name);
+	printf("  -c  compress blocks. The device needs a leveler with compression to read the image\n");
+	printf("  -b  number of blocks, by default the image size / 4096\n");
+	printf("build creates a FlashFS with the files, named like the files without the directory\n");
+	printf("verify checks the headers, that mounting doesn't change the image and that the files match\n");
+	exit(1);
+}
+
+static const char* baseName(const char* path) {
+	const char* slash = strrchr(path, '/');
+	return slash ? slash + 1 : path;
+}
+
+//reads a whole file into a malloced buffer. Returns 0 on errors
+static uint8_t* readFile(const char* fileName, long* size) {
+	FILE* f = fopen(fileName, "rb");
+	if(!f) {
+		perror(fileName);
+		return 0;
+	}
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t* buf = (uint8_t*)malloc(*size + 1);
+	if(fread(buf, 1, *size, f) != (size_t)*size) {
+		perror(fileName);
+		free(buf);
+		buf = 0;
+	}
+	fclose(f);
+	return buf;
+}
+
+//formats the leveler and the file system on the flash and adds the files
+static int writeImage(DummyFlash& flash, int blocks, bool compression, int fileCount, char** files) {
+	HostLeveler leveler(flash, blocks, compression);
+	FlashFS fs(leveler);
+	if(!leveler.format() || !fs.format()) {
+		printf("format failed\n");
+		return 1;
+	}
+	int res = 0;
+	for(int i=0; i<fileCount && res == 0; i++) {
+		long size;
+		uint8_t* data = readFile(files[i], &size);
+		if(!data) {
+			res = 1;
+			break;
+		}
+		const char* name = baseName(files[i]);
+		if(strlen(name) > FLASHFS_NAME_LENGTH) {
+			printf("%s: the name is longer than %i characters\n", files[i], FLASHFS_NAME_LENGTH);
+			res = 1;
+		} else if(fs.open(name) >= 0) {
+			printf("%s: there already is a file named %s\n", files[i], name);
+			res = 1;
+		} else {
+			int fd = fs.create(name);
+			if(fd < 0 || fs.append(fd, data, size) != size) {
+				printf("%s: doesn't fit into the image\n", files[i]);
+				res = 1;
+			}
+		}
+		free(data);
+	}
+	fs.sync();
+	const FlashWearLevelerStats& stats = leveler.getStats();
+	printf("%i files, %u blocks written, %u compressed, %u bytes programmed\n", fileCount,
+			stats.flushes, stats.compressedFlushes, stats.bytesProgrammed);
+	return res;
+}
+
+static int build(const char* image, int blocks, bool compression, int fileCount, char** files) {
+	if(blocks <= 1) {
+		printf("build needs the number of blocks\n");
+		return 1;
+	}
+	//start with a new chip
+	unlink(image);
+	char wearFile[1024];
+	snprintf(wearFile, sizeof(wearFile), "%s.wear", image);
+	unlink(wearFile);
+
+	int res = 1;
+	{
+		DummyFlash flash(blocks, image);
+		if(flash.isValid()) res = writeImage(flash, blocks, compression, fileCount, files);
+	}
+	//the erases of the build don't wear the device, a failed build leaves no partial image
+	unlink(wearFile);
+	if(res != 0) unlink(image);
+	return res;
+}
+
+//the image in a RAM flash, so that mounting it doesn't touch the file
+static DummyFlash* loadImage(const char* image, int* blocks) {
+	long size;
+	uint8_t* data = readFile(image, &size);
+	if(!data) return 0;
+	if(*blocks == 0) *blocks = size / 4096;
+	if(size < (long)*blocks * 4096 || *blocks <= 1) {
+		printf("%s: %li bytes is too small for %i blocks\n", image, size, *blocks);
+		free(data);
+		return 0;
+	}
+	DummyFlash* flash = new DummyFlash(*blocks);
+	//the new flash isn't erased
+	flash->chipErase();
+	for(long addr=0; addr<(long)*blocks * 4096; addr+=4096) {
+		flash->writeBytes(addr, data + addr, 4096);
+	}
+	free(data);
+	return flash;
+}
+
+static long totalErases(DummyFlash& flash, int blocks) {
+	long erases = 0;
+	for(int i=0; i<blocks; i++) erases += flash.getEraseCount(i);
+	return erases;
+}
+
+static bool isBlank(DummyFlash& flash, int block) {
+	uint8_t buf[4096];
+	flash.readBytes((long)block * 4096, buf, sizeof(buf));
+	for(int i=0; i<(int)sizeof(buf); i++) {
+		if(buf[i] != 0xff) return false;
+	}
+	return true;
+}
+
+static void listFiles(FlashFS& fs) {
+	for(int fd=0; fd<FLASHFS_MAX_FILES; fd++) {
+		const flashfs_entry_t* entry = fs.stat(fd);
+		if(!entry) continue;
+		printf("  %-*.*s %8u bytes  blocks", FLASHFS_NAME_LENGTH, FLASHFS_NAME_LENGTH, entry->name, entry->size);
+		for(int e=0; e<FLASHFS_MAX_EXTENTS && entry->extents[e].count; e++) {
+			printf(" %u-%u", entry->extents[e].start, entry->extents[e].start + entry->extents[e].count - 1);
+		}
+		printf("\n");
+	}
+}
+
+static int dump(const char* image, int blocks, bool compression) {
+	DummyFlash* flash = loadImage(image, &blocks);
+	if(!flash) return 1;
+
+	//the wear counters of an image, which was used with a file backed DummyFlash
+	long wearSize = 0;
+	char wearFile[1024];
+	snprintf(wearFile, sizeof(wearFile), "%s.wear", image);
+	int* wear = access(wearFile, R_OK) == 0 ? (int*)readFile(wearFile, &wearSize) : 0;
+	if(wear && wearSize < blocks * (long)sizeof(int)) {
+		free(wear);
+		wear = 0;
+	}
+
+	int used = 0, compressed = 0, erased = 0, dirty = 0, deleted = 0, journals = 0;
+	fwl_block_t* map = new fwl_block_t[blocks];
+	memset(map, 0xff, blocks * sizeof(fwl_block_t));
+	printf("pblock  header  state\n");
+	for(int p=0; p<blocks; p++) {
+		fwl_block_t header;
+		flash->readBytes((long)p * 4096, &header, sizeof(header));
+		printf("%6i  0x%0*x  ", p, (int)sizeof(header) * 2, (unsigned)header);
+		if(header == HEADER_ERASED) {
+			if(isBlank(*flash, p)) {
+				printf("free");
+				erased++;
+			} else {
+				printf("free, not erased");
+				dirty++;
+			}
+		} else if(header == HEADER_JOURNAL) {
+			printf("journal");
+			journals++;
+		} else if(!(header & HEADER_NOT_DELETED)) {
+			printf("deleted vblock %u", HEADER_ID(header));
+			deleted++;
+		} else {
+			printf("vblock %u%s", HEADER_ID(header), header & HEADER_COMPRESSED ? " compressed" : "");
+			used++;
+			if(header & HEADER_COMPRESSED) compressed++;
+			if(HEADER_ID(header) < (unsigned)blocks) map[HEADER_ID(header)] = p;
+		}
+		if(wear) printf("  erases %i", wear[p]);
+		printf("\n");
+	}
+
+	printf("\nvblock -> pblock\n");
+	for(int v=0; v<blocks; v++) {
+		if(map[v] != HEADER_ERASED) printf("%6i -> %u\n", v, (unsigned)map[v]);
+	}
+
+	printf("\n%i blocks: %i used (%i compressed), %i free, %i free but not erased, %i deleted, %i journal\n",
+			blocks, used, compressed, erased, dirty, deleted, journals);
+	if(wear) {
+		int minErase = wear[0], maxErase = wear[0];
+		long sum = 0;
+		for(int p=0; p<blocks; p++) {
+			if(wear[p] < minErase) minErase = wear[p];
+			if(wear[p] > maxErase) maxErase = wear[p];
+			sum += wear[p];
+		}
+		printf("erases: min %i max %i avg %.1f\n", minErase, maxErase, (double)sum / blocks);
+	}
+
+	HostLeveler leveler(*flash, blocks, compression);
+	FlashFS fs(leveler);
+	if(leveler.initialize() && fs.mount()) {
+		printf("\nfiles:\n");
+		listFiles(fs);
+	} else {
+		printf("\nno file system\n");
+	}
+	free(wear);
+	delete[] map;
+	delete flash;
+	return 0;
+}
+
+static int verify(const char* image, int blocks, bool compression, int fileCount, char** files) {
+	DummyFlash* flash = loadImage(image, &blocks);
+	if(!flash) return 1;
+	int errors = 0;
+
+	fwl_block_t* owner = new fwl_block_t[blocks];
+	memset(owner, 0xff, blocks * sizeof(fwl_block_t));
+	for(int p=0; p<blocks; p++) {
+		fwl_block_t header;
+		flash->readBytes((long)p * 4096, &header, sizeof(header));
+		if(header == HEADER_ERASED) {
+			if(!isBlank(*flash, p)) {
+				printf("pblock %i: free, but not erased\n", p);
+				errors++;
+			}
+		} else if(header == HEADER_JOURNAL) {
+			printf("pblock %i: unfinished transaction, the mount would recover it\n", p);
+			errors++;
+		} else if(!(header & HEADER_NOT_DELETED)) {
+			//released, the device erases it before it reuses it
+		} else if(HEADER_ID(header) >= (unsigned)blocks) {
+			printf("pblock %i: vblock %u is out of range\n", p, HEADER_ID(header));
+			errors++;
+		} else if(owner[HEADER_ID(header)] != HEADER_ERASED) {
+			printf("pblock %i: vblock %u is also in pblock %u\n", p, HEADER_ID(header), (unsigned)owner[HEADER_ID(header)]);
+			errors++;
+		} else {
+			owner[HEADER_ID(header)] = p;
+			if((header & HEADER_COMPRESSED) && !compression) {
+				printf("pblock %i: compressed, the device needs compression (-c)\n", p);
+				errors++;
+			}
+		}
+	}
+	delete[] owner;
+
+	//the first boot must not write or erase anything
+	long imageSize = (long)blocks * 4096;
+	uint8_t* before = (uint8_t*)malloc(imageSize);
+	uint8_t* after = (uint8_t*)malloc(imageSize);
+	flash->readBytes(0, before, imageSize);
+	long erases = totalErases(*flash, blocks);
+	HostLeveler leveler(*flash, blocks, compression);
+	FlashFS fs(leveler);
+	bool mounted = leveler.initialize();
+	if(!mounted) {
+		printf("the leveler doesn't mount the image\n");
+		errors++;
+	} else if(!fs.mount()) {
+		printf("there is no file system\n");
+		errors++;
+		mounted = false;
+	}
+	flash->readBytes(0, after, imageSize);
+	if(totalErases(*flash, blocks) != erases || memcmp(before, after, imageSize) != 0) {
+		printf("mounting changed the image\n");
+		errors++;
+	}
+	free(before);
+	free(after);
+
+	for(int i=0; i<fileCount && mounted; i++) {
+		long size;
+		uint8_t* data = readFile(files[i], &size);
+		if(!data) {
+			errors++;
+			continue;
+		}
+		int fd = fs.open(baseName(files[i]));
+		uint8_t* stored = (uint8_t*)malloc(size + 1);
+		if(fd < 0) {
+			printf("%s: not in the image\n", files[i]);
+			errors++;
+		} else if(fs.size(fd) != size || fs.read(fd, 0, stored, size) != size || memcmp(stored, data, size) != 0) {
+			printf("%s: differs from the image\n", files[i]);
+			errors++;
+		}
+		free(stored);
+		free(data);
+	}
+	delete flash;
+
+	if(errors) {
+		printf("%s: %i errors\n", image, errors);
+		return 1;
+	}
+	printf("%s: ok\n", image);
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	if(argc < 2) usage(argv[0]);
+	const char* command = argv[1];
+	bool compression = false;
+	int blocks = 0;
+	int opt;
+	optind = 2;
+	while((opt = getopt(argc, argv, "cb:")) != -1) {
+		switch(opt) {
+		case 'c': compression = true; break;
+		case 'b': blocks = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if(optind >= argc) usage(argv[0]);
+	const char* image = argv[optind++];
+	if(strcmp(command, "build") == 0) {
+		return build(image, blocks, compression, argc - optind, argv + optind);
+	} else if(strcmp(command, "dump") == 0 && optind == argc) {
+		return dump(image, blocks, compression);
+	} else if(strcmp(command, "verify") == 0) {
+		return verify(image, blocks, compression, argc - optind, argv + optind);
+	}
+	usage(argv[0]);
+	return 1;
+}
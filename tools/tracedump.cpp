@@ -0,0 +1,80 @@
+//prints a trace, which was saved with flashTraceSave()
+#include "../FlashTrace.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, const char** argv) {
+	if(argc != 2) {
+		printf("usage: %s <trace>\n", argv[0]);
+		return 1;
+	}
+	FILE* f = fopen(argv[1], "rb");
+	if(!f) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	FlashTraceEvent e;
+	uint32_t count[FT_OP_COUNT] = {0};
+	uint64_t bytes[FT_OP_COUNT] = {0};
+	uint32_t start = 0, last = 0;
+	long n = 0;
+	while(fread(&e, sizeof(e), 1, f) == 1) {
+		if(n == 0) start = e.time;
+		last = e.time;
+		n++;
+		printf("%10u %-15s", e.time - start, flashTraceOpName(e.op));
+		switch(e.op) {
+		case FT_INIT:
+			printf(" blocks %u", e.block);
+			break;
+		case FT_READ_BYTE: case FT_WRITE_BYTE:
+			printf(" addr %u", e.addr);
+			break;
+		case FT_READ: case FT_WRITE: case FT_DISCARD:
+			printf(" addr %u len %u", e.addr, e.len);
+			break;
+		case FT_FLUSH: case FT_SKIP_FLUSH: case FT_RELOCATE:
+			printf(" vblock %u", e.block);
+			break;
+		case FT_TX_COMMIT:
+			printf(" %s", e.len ? "durable" : "deferred");
+			break;
+		case FT_SNAPSHOT:
+			printf(" %s", e.len ? "taken" : "released");
+			break;
+		case FT_HOLD:
+			printf(" vblock %u pblock %u", e.block, e.addr);
+			break;
+		case FT_ACTIVATE:
+			printf(" vblock %u pblock %u", e.block, e.addr);
+			break;
+		case FT_WRITE_BLOCK:
+			printf(" vblock %u pblock %u programmed %u", e.block, e.addr, e.len);
+			break;
+		case FT_RELEASE: case FT_RECOVER_DELETED: case FT_ERASE:
+			printf(" pblock %u", e.addr);
+			break;
+		case FT_RECOVER_JOURNAL:
+			printf(" pblock %u %s entries %u", e.addr, e.block ? "committed" : "uncommitted", e.len);
+			break;
+		}
+		printf("\n");
+		if(e.op < FT_OP_COUNT) {
+			count[e.op]++;
+			bytes[e.op] += e.len;
+		}
+	}
+	fclose(f);
+
+	printf("\n%li events in %u us\n", n, last - start);
+	for(int op=0; op<FT_OP_COUNT; op++) {
+		if(!count[op]) continue;
+		printf("%-15s %8u", flashTraceOpName(op), count[op]);
+		if(op == FT_READ || op == FT_WRITE || op == FT_DISCARD || op == FT_WRITE_BLOCK) {
+			printf("  %10llu bytes", (unsigned long long)bytes[op]);
+		}
+		printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,121 @@
+//replays the api calls of a trace, which was saved with flashTraceSave(), against DummyFlash
+//the trace doesn't contain the written data, every write stores a pattern derived from its position in the trace
+#include "../DummyFlash.h"
+#include "../FlashWearLeveler.h"
+#include "../FlashTrace.h"
+#include "HostLeveler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+static void usage(const char* name) {
+	printf("usage: %s [-c] [-n] [-b blocks] <trace>\n", name);
+	printf("  -c  compress blocks\n");
+	printf("  -n  no hot/cold separation\n");
+	printf("  -b  number of blocks, if the trace doesn't start with init\n");
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	bool compression = false, hotCold = true;
+	int blocks = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "cnb:")) != -1) {
+		switch(opt) {
+		case 'c': compression = true; break;
+		case 'n': hotCold = false; break;
+		case 'b': blocks = atoi(argv[optind - 1]); break;
+		default: usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1) usage(argv[0]);
+
+	FILE* f = fopen(argv[optind], "rb");
+	if(!f) {
+		perror(argv[optind]);
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	long n = ftell(f) / sizeof(FlashTraceEvent);
+	fseek(f, 0, SEEK_SET);
+	FlashTraceEvent* events = (FlashTraceEvent*)malloc(n * sizeof(FlashTraceEvent));
+	if(fread(events, sizeof(FlashTraceEvent), n, f) != (size_t)n) {
+		perror(argv[optind]);
+		return 1;
+	}
+	fclose(f);
+
+	//the first init tells the size, unless the ring buffer lost it
+	long i;
+	for(i=0; i<n && blocks == 0; i++) {
+		if(events[i].op == FT_INIT) blocks = events[i].block;
+	}
+	if(blocks <= 0) {
+		printf("the trace doesn't contain init, use -b\n");
+		return 1;
+	}
+
+	DummyFlash flash(blocks);
+	HostLeveler leveler(flash, blocks, compression);
+	leveler.setHotColdSeparation(hotCold);
+	leveler.format();
+	leveler.resetStats();
+
+	uint8_t* buf = (uint8_t*)malloc((long)blocks * 4096);
+	fwl_block_t* snapshot = new fwl_block_t[blocks];
+	long replayed = 0;
+	int lastOp = -1;
+	clock_t start = clock();
+	for(i=0; i<n; i++) {
+		const FlashTraceEvent& e = events[i];
+		switch(e.op) {
+		case FT_FORMAT: leveler.format(); break;
+		//format() initializes itself
+		case FT_INIT: if(lastOp != FT_FORMAT) leveler.initialize(); break;
+		case FT_READ_BYTE: leveler.readByte(e.addr); break;
+		case FT_READ: leveler.readBytes(e.addr, buf, e.len); break;
+		case FT_WRITE_BYTE: leveler.writeByte(e.addr, i); break;
+		case FT_WRITE:
+			memset(buf, i, e.len);
+			leveler.writeBytes(e.addr, buf, e.len);
+			break;
+		case FT_DISCARD: leveler.discard(e.addr, e.len); break;
+		case FT_FLUSH: leveler.flush(); break;
+		case FT_TX_BEGIN: leveler.beginTransaction(); break;
+		case FT_TX_COMMIT: leveler.commitTransaction(e.len != 0); break;
+		case FT_TX_ABORT: leveler.abortTransaction(); break;
+		case FT_SNAPSHOT:
+			if(e.len) leveler.takeSnapshot(snapshot);
+			else leveler.releaseSnapshot();
+			break;
+		case FT_SLEEP: leveler.sleep(); break;
+		default:
+			//internal events just document, what happened
+			continue;
+		}
+		lastOp = e.op;
+		replayed++;
+	}
+	leveler.flush();
+	double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+	free(buf);
+	free(events);
+	delete[] snapshot;
+
+	const FlashWearLevelerStats& stats = leveler.getStats();
+	long erases = 0;
+	int minErase = 1 << 30, maxErase = 0;
+	for(i=0; i<blocks; i++) {
+		int c = flash.getEraseCount(i);
+		erases += c;
+		if(c < minErase) minErase = c;
+		if(c > maxErase) maxErase = c;
+	}
+	printf("replayed %li of %li events on %i blocks in %.3fs\n", replayed, n, blocks, seconds);
+	printf("flushes %u (%u skipped, %u relocations), %u bytes programmed\n",
+			stats.flushes, stats.skippedFlushes, stats.relocations, stats.bytesProgrammed);
+	printf("erases %li, min %i, max %i\n", erases, minErase, maxErase);
+	return 0;
+}